@@ -0,0 +1,394 @@
+#ifndef _EXPR_H_
+#define _EXPR_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "smatrix.hpp"
+
+// Lazy element-wise matrix expressions. Lazy(a) + b - c * 2.0 builds a small
+// tree of nodes instead of a matrix per operator; converting the tree to a
+// matrix (or calling Evaluate) computes every row in one pass over the
+// merged nonzeros of all operands, with no intermediate matrices.
+//
+// Sums, differences, scalar arithmetic and Map / Pow are lazy. A product
+// is computed eagerly and enters the tree as an operand.
+//
+// Every node walks one row at a time: StartRow(row) rewinds it, NextIndex()
+// is the smallest stored column not visited yet and At(col), called with
+// increasing columns, gives the value of the cell. Background() is the
+// value of a cell no operand stores, it becomes the offset of the result.
+
+// A matrix operand. Refers to the matrix, or owns it if it was computed
+// on the way (a product) or given as a temporary.
+template<typename T>
+class LeafExpr : public MatrixExpression {
+public:
+    using value_type = T;
+    using index_type = std::size_t;
+    using size_type  = std::size_t;
+    using matrix_type = SparseMatrixBase<T>;
+
+    explicit LeafExpr(const matrix_type& matrix)
+        : matrix_(&matrix) {}
+
+    explicit LeafExpr(std::shared_ptr<const matrix_type> matrix)
+        : owner_(std::move(matrix))
+        , matrix_(owner_.get()) {}
+
+    size_type Rows() const {
+        return matrix_->Rows();
+    }
+
+    size_type Cols() const {
+        return matrix_->Cols();
+    }
+
+    size_type Work() const {
+        return matrix_->RealSize();
+    }
+
+    const matrix_type& Matrix() const {
+        return *matrix_;
+    }
+
+    void StartRow(index_type row) {
+        view_ = matrix_->NonZeros(row);
+        pos_ = 0;
+    }
+
+    index_type NextIndex() const {
+        return pos_ < view_.RealSize() ? view_.Indices()[pos_] : matrix_->Cols();
+    }
+
+    value_type At(index_type col) {
+        if (pos_ < view_.RealSize() && view_.Indices()[pos_] == col)
+            return view_.Values()[pos_++] + matrix_->Offset();
+
+        return matrix_->Offset();
+    }
+
+    value_type Background() const {
+        return matrix_->Offset();
+    }
+
+private:
+    std::shared_ptr<const matrix_type> owner_;
+    const matrix_type *matrix_;
+    typename matrix_type::RowView view_ = typename matrix_type::RowView(nullptr, nullptr, 0);
+    size_type pos_ = 0;
+};
+
+// op(lhs, rhs) cell by cell.
+template<typename L, typename R, typename Op>
+class BinaryExpr : public MatrixExpression {
+public:
+    using value_type = typename L::value_type;
+    using index_type = std::size_t;
+    using size_type  = std::size_t;
+
+    BinaryExpr(L lhs, R rhs, Op op)
+        : lhs_(std::move(lhs))
+        , rhs_(std::move(rhs))
+        , op_(op) {
+        if (lhs_.Rows() != rhs_.Rows() || lhs_.Cols() != rhs_.Cols()) {
+            throw std::invalid_argument(MATRIX_SIZE_DIFFER);
+        }
+    }
+
+    size_type Rows() const {
+        return lhs_.Rows();
+    }
+
+    size_type Cols() const {
+        return lhs_.Cols();
+    }
+
+    size_type Work() const {
+        return lhs_.Work() + rhs_.Work();
+    }
+
+    void StartRow(index_type row) {
+        lhs_.StartRow(row);
+        rhs_.StartRow(row);
+    }
+
+    index_type NextIndex() const {
+        return std::min(lhs_.NextIndex(), rhs_.NextIndex());
+    }
+
+    value_type At(index_type col) {
+        return op_(lhs_.At(col), rhs_.At(col));
+    }
+
+    value_type Background() const {
+        return op_(lhs_.Background(), rhs_.Background());
+    }
+
+private:
+    L lhs_;
+    R rhs_;
+    Op op_;
+};
+
+// f(x) cell by cell.
+template<typename E, typename F>
+class MapExpr : public MatrixExpression {
+public:
+    using value_type = typename E::value_type;
+    using index_type = std::size_t;
+    using size_type  = std::size_t;
+
+    MapExpr(E expr, F f)
+        : expr_(std::move(expr))
+        , f_(f) {}
+
+    size_type Rows() const {
+        return expr_.Rows();
+    }
+
+    size_type Cols() const {
+        return expr_.Cols();
+    }
+
+    size_type Work() const {
+        return expr_.Work();
+    }
+
+    void StartRow(index_type row) {
+        expr_.StartRow(row);
+    }
+
+    index_type NextIndex() const {
+        return expr_.NextIndex();
+    }
+
+    value_type At(index_type col) {
+        return f_(expr_.At(col));
+    }
+
+    value_type Background() const {
+        return f_(expr_.Background());
+    }
+
+private:
+    E expr_;
+    F f_;
+};
+
+template<typename X>
+struct IsMatrixExpression : std::is_base_of<MatrixExpression, std::decay_t<X>> {};
+
+namespace detail {
+
+template<typename T>
+std::true_type IsSparseMatrixTest(const SparseMatrixBase<T>*);
+std::false_type IsSparseMatrixTest(...);
+
+template<typename X>
+struct IsSparseMatrix : decltype(IsSparseMatrixTest(std::declval<std::decay_t<X>*>())) {};
+
+// Operands of the lazy operators: at least one expression, the other one
+// an expression or a matrix.
+template<typename L, typename R>
+using EnableIfOperands = std::enable_if_t<
+    (IsMatrixExpression<L>::value && (IsMatrixExpression<R>::value || IsSparseMatrix<R>::value))
+    || (IsSparseMatrix<L>::value && IsMatrixExpression<R>::value)>;
+
+template<typename E>
+using EnableIfExpression = std::enable_if_t<IsMatrixExpression<E>::value>;
+
+template<typename E, std::enable_if_t<IsMatrixExpression<E>::value, int> = 0>
+const E& AsExpression(const E& expr) {
+    return expr;
+}
+
+template<typename T>
+LeafExpr<T> AsExpression(const SparseMatrixBase<T>& matrix) {
+    return LeafExpr<T>(matrix);
+}
+
+// A temporary would be gone before the expression is evaluated, the leaf
+// takes it over.
+template<typename T>
+LeafExpr<T> AsExpression(SparseMatrixBase<T>&& matrix) {
+    return LeafExpr<T>(std::make_shared<const SparseMatrixBase<T>>(std::move(matrix)));
+}
+
+// A matrix for an operand of an eager operation. Leaves hand out their
+// matrix, anything else is evaluated.
+template<typename T>
+std::shared_ptr<const SparseMatrixBase<T>> AsMatrix(const SparseMatrixBase<T>& matrix) {
+    return std::shared_ptr<const SparseMatrixBase<T>>(std::shared_ptr<const SparseMatrixBase<T>>(), &matrix);
+}
+
+template<typename T>
+std::shared_ptr<const SparseMatrixBase<T>> AsMatrix(const LeafExpr<T>& leaf) {
+    return AsMatrix(leaf.Matrix());
+}
+
+template<typename E, std::enable_if_t<IsMatrixExpression<E>::value, int> = 0>
+std::shared_ptr<const SparseMatrixBase<typename E::value_type>> AsMatrix(const E& expr) {
+    return std::make_shared<const SparseMatrixBase<typename E::value_type>>(Evaluate(expr));
+}
+
+} // namespace detail
+
+// Starts an expression. A named matrix is referred to and must outlive the
+// expression; a temporary is moved into it. Matrix operands of the lazy
+// operators below are kept the same way, so Lazy(a) + (b + c) owns b + c.
+template<typename T>
+LeafExpr<T> Lazy(const SparseMatrixBase<T>& matrix) {
+    return detail::AsExpression(matrix);
+}
+
+template<typename T>
+LeafExpr<T> Lazy(SparseMatrixBase<T>&& matrix) {
+    return detail::AsExpression(std::move(matrix));
+}
+
+template<typename L, typename R, typename = detail::EnableIfOperands<L, R>>
+auto operator+(L&& lhs, R&& rhs) {
+    auto l = detail::AsExpression(std::forward<L>(lhs));
+    auto r = detail::AsExpression(std::forward<R>(rhs));
+    using value_type = typename decltype(l)::value_type;
+    return BinaryExpr<decltype(l), decltype(r), std::plus<value_type>>(l, r, std::plus<value_type>());
+}
+
+template<typename L, typename R, typename = detail::EnableIfOperands<L, R>>
+auto operator-(L&& lhs, R&& rhs) {
+    auto l = detail::AsExpression(std::forward<L>(lhs));
+    auto r = detail::AsExpression(std::forward<R>(rhs));
+    using value_type = typename decltype(l)::value_type;
+    return BinaryExpr<decltype(l), decltype(r), std::minus<value_type>>(l, r, std::minus<value_type>());
+}
+
+// Cell by cell f(x) of an expression or a matrix.
+template<typename X, typename F,
+         typename = std::enable_if_t<IsMatrixExpression<X>::value || detail::IsSparseMatrix<X>::value>>
+auto Map(X&& operand, F f) {
+    auto expr = detail::AsExpression(std::forward<X>(operand));
+    return MapExpr<decltype(expr), F>(expr, f);
+}
+
+template<typename X,
+         typename = std::enable_if_t<IsMatrixExpression<X>::value || detail::IsSparseMatrix<X>::value>>
+auto Pow(X&& operand, double exponent) {
+    using value_type = typename std::decay_t<decltype(detail::AsExpression(operand))>::value_type;
+    return Map(std::forward<X>(operand), [exponent](const value_type& value) { return std::pow(value, exponent); });
+}
+
+template<typename E, typename = detail::EnableIfExpression<E>>
+auto operator*(const E& expr, const typename E::value_type& scalar) {
+    return Map(expr, [scalar](const typename E::value_type& value) { return value * scalar; });
+}
+
+template<typename E, typename = detail::EnableIfExpression<E>>
+auto operator*(const typename E::value_type& scalar, const E& expr) {
+    return expr * scalar;
+}
+
+template<typename E, typename = detail::EnableIfExpression<E>>
+auto operator/(const E& expr, const typename E::value_type& scalar) {
+    return Map(expr, [scalar](const typename E::value_type& value) { return value / scalar; });
+}
+
+template<typename E, typename = detail::EnableIfExpression<E>>
+auto operator+(const E& expr, const typename E::value_type& scalar) {
+    return Map(expr, [scalar](const typename E::value_type& value) { return value + scalar; });
+}
+
+template<typename E, typename = detail::EnableIfExpression<E>>
+auto operator-(const E& expr, const typename E::value_type& scalar) {
+    return Map(expr, [scalar](const typename E::value_type& value) { return value - scalar; });
+}
+
+template<typename E, typename = detail::EnableIfExpression<E>>
+auto operator-(const E& expr) {
+    return Map(expr, [](const typename E::value_type& value) { return -value; });
+}
+
+// Matrix products are not element-wise: both sides are evaluated and
+// multiplied right away, the product joins the expression as an operand.
+template<typename L, typename R, typename = detail::EnableIfOperands<L, R>>
+auto operator*(const L& lhs, const R& rhs) {
+    const auto l = detail::AsMatrix(lhs);
+    const auto r = detail::AsMatrix(rhs);
+    using value_type = typename std::decay_t<decltype(*l)>::value_type;
+    return LeafExpr<value_type>(std::make_shared<const SparseMatrixBase<value_type>>(*l * *r));
+}
+
+// Computes the expression row by row. Rows are independent, so big
+// expressions are cut into chunks that threads evaluate on their own copy
+// of the tree, the chunks are then put together like in Multiply.
+template<typename E>
+SparseMatrixBase<typename E::value_type> Evaluate(const E& expr, ThreadPool& pool) {
+    using value_type = typename E::value_type;
+    using size_type = std::size_t;
+    using index_type = std::size_t;
+
+    const size_type rows = expr.Rows();
+    const size_type cols = expr.Cols();
+
+    // Cells no operand stores get the background as offset. If it is not
+    // finite every cell is computed and stored instead.
+    value_type offset = expr.Background();
+    bool every_cell = false;
+    if constexpr (std::is_floating_point<value_type>::value) {
+        every_cell = !std::isfinite(offset);
+    }
+    if (every_cell) {
+        offset = value_type();
+    }
+
+    const size_type chunks = std::max<size_type>(1, std::min(rows,
+        expr.Work() < PARALLEL_MIN_FLOPS ? 1 : pool.Threads() * 4));
+
+    typename SparseMatrixBase<value_type>::CsrStorage result;
+    result.row_ptr.resize(rows + 1);
+
+    std::vector<std::vector<index_type>> chunk_cols(chunks);
+    std::vector<std::vector<value_type>> chunk_values(chunks);
+
+    pool.Run(chunks, [&](size_type chunk) {
+        E local = expr;
+        std::vector<index_type>& out_cols = chunk_cols[chunk];
+        std::vector<value_type>& out_values = chunk_values[chunk];
+
+        for (index_type row = rows * chunk / chunks; row < rows * (chunk + 1) / chunks; row++) {
+            const size_type before = out_values.size();
+            local.StartRow(row);
+
+            for (index_type col = every_cell ? 0 : local.NextIndex(); col < cols;
+                 col = every_cell ? col + 1 : local.NextIndex()) {
+                const value_type value = local.At(col) - offset;
+                if (value != value_type()) {
+                    out_cols.push_back(col);
+                    out_values.push_back(value);
+                }
+            }
+
+            result.row_ptr[row + 1] = out_values.size() - before;
+        }
+    });
+
+    for (index_type row = 0; row < rows; row++) {
+        result.row_ptr[row + 1] += result.row_ptr[row];
+    }
+
+    for (size_type chunk = 0; chunk < chunks; chunk++) {
+        result.col_idx.insert(result.col_idx.end(), chunk_cols[chunk].begin(), chunk_cols[chunk].end());
+        result.values.insert(result.values.end(), chunk_values[chunk].begin(), chunk_values[chunk].end());
+    }
+
+    SparseMatrixBase<value_type> matrix(rows, cols, std::move(result));
+    matrix.Shift(offset);
+    return matrix;
+}
+
+#endif
@@ -0,0 +1,339 @@
+#ifndef _GEMM_H_
+#define _GEMM_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#include "thread_pool.hpp"
+#include "vmatrix.hpp"
+
+// Dense C = alpha * A * B + beta * C, blocked the usual way: B is cut into
+// GEMM_KC x GEMM_NC panels packed to stay in L3, A into GEMM_MC x GEMM_KC
+// blocks packed to stay in L2, and a register blocked microkernel computes
+// GEMM_MR x GEMM_NR tiles of C from slivers of both that stay in L1. Packed
+// panels are contiguous in the order the microkernel reads them, zero
+// padded to whole tiles, so the kernel never checks bounds.
+//
+// For double the microkernel uses AVX2 and FMA if the CPU has them, checked
+// at run time; other types and older CPUs get the portable kernel.
+//
+// Products of at least GEMM_PARALLEL_MIN_FLOPS run on the pool: packing is
+// split by blocks of A and column groups of B, then every task computes
+// the tiles of one block of rows and one column group of C. Every cell is
+// summed by one task in the same order whatever the thread count, so the
+// result does not depend on it.
+constexpr std::size_t GEMM_MR = 6;
+constexpr std::size_t GEMM_NR = 8;
+constexpr std::size_t GEMM_KC = 256;
+constexpr std::size_t GEMM_MC = 96;
+constexpr std::size_t GEMM_NC = 2048;
+constexpr std::size_t GEMM_PARALLEL_MIN_FLOPS = 1 << 20;
+
+namespace detail {
+
+template<typename T>
+using GemmBuffer = std::vector<T, AlignedAllocator<T, VMATRIX_ALIGNMENT>>;
+
+// beta * value, where a zero beta drops the value whatever it is (even inf
+// or nan), like BLAS does. Also used by the sparse products.
+template<typename T>
+T GemmScaled(const T& beta, const T& value) {
+    return beta == T() ? T() : beta * value;
+}
+
+// alpha * A[0:mc, 0:kc] as GEMM_MR row slivers, column by column.
+template<typename T>
+void PackA(std::size_t mc, std::size_t kc, const T *a, std::size_t lda, const T& alpha, T *out) {
+    for (std::size_t ir = 0; ir < mc; ir += GEMM_MR) {
+        const std::size_t mr = std::min(GEMM_MR, mc - ir);
+        for (std::size_t p = 0; p < kc; p++) {
+            for (std::size_t i = 0; i < GEMM_MR; i++) {
+                *out++ = i < mr ? alpha * a[(ir + i) * lda + p] : T();
+            }
+        }
+    }
+}
+
+// B[0:kc, 0:nc] as GEMM_NR column slivers, row by row.
+template<typename T>
+void PackB(std::size_t kc, std::size_t nc, const T *b, std::size_t ldb, T *out) {
+    for (std::size_t jr = 0; jr < nc; jr += GEMM_NR) {
+        const std::size_t nr = std::min(GEMM_NR, nc - jr);
+        for (std::size_t p = 0; p < kc; p++) {
+            const T *row = b + p * ldb + jr;
+            for (std::size_t j = 0; j < GEMM_NR; j++) {
+                *out++ = j < nr ? row[j] : T();
+            }
+        }
+    }
+}
+
+// The mr x nr corner of a GEMM_MR x GEMM_NR tile goes to C.
+template<typename T>
+void StoreTile(const T *tile, T *c, std::size_t ldc, std::size_t mr, std::size_t nr, const T& beta) {
+    for (std::size_t i = 0; i < mr; i++) {
+        for (std::size_t j = 0; j < nr; j++) {
+            c[i * ldc + j] = GemmScaled(beta, c[i * ldc + j]) + tile[i * GEMM_NR + j];
+        }
+    }
+}
+
+template<typename T>
+using GemmKernel = void (*)(std::size_t kc, const T *a, const T *b, T *c, std::size_t ldc,
+                            std::size_t mr, std::size_t nr, const T& beta);
+
+template<typename T>
+void GemmKernelPortable(std::size_t kc, const T *a, const T *b, T *c, std::size_t ldc,
+                        std::size_t mr, std::size_t nr, const T& beta) {
+    T tile[GEMM_MR * GEMM_NR] = {};
+    for (std::size_t p = 0; p < kc; p++) {
+        for (std::size_t i = 0; i < GEMM_MR; i++) {
+            const T scale = a[i];
+            for (std::size_t j = 0; j < GEMM_NR; j++) {
+                tile[i * GEMM_NR + j] += scale * b[j];
+            }
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    StoreTile(tile, c, ldc, mr, nr, beta);
+}
+
+#ifdef GEMM_HAVE_AVX2
+// 6 x 8 tile in twelve ymm accumulators: every step broadcasts one value of
+// the A sliver and multiplies it by the two halves of the B sliver.
+__attribute__((target("avx2,fma")))
+inline void GemmKernelAvx2(std::size_t kc, const double *a, const double *b, double *c,
+                           std::size_t ldc, std::size_t mr, std::size_t nr, const double& beta) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+
+    for (std::size_t p = 0; p < kc; p++) {
+        const __m256d b0 = _mm256_load_pd(b);
+        const __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d ai;
+
+        ai = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(ai, b0, c00);
+        c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10);
+        c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20);
+        c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30);
+        c31 = _mm256_fmadd_pd(ai, b1, c31);
+        ai = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(ai, b0, c40);
+        c41 = _mm256_fmadd_pd(ai, b1, c41);
+        ai = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(ai, b0, c50);
+        c51 = _mm256_fmadd_pd(ai, b1, c51);
+
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    alignas(32) double tile[GEMM_MR * GEMM_NR];
+    _mm256_store_pd(tile + 0,  c00);
+    _mm256_store_pd(tile + 4,  c01);
+    _mm256_store_pd(tile + 8,  c10);
+    _mm256_store_pd(tile + 12, c11);
+    _mm256_store_pd(tile + 16, c20);
+    _mm256_store_pd(tile + 20, c21);
+    _mm256_store_pd(tile + 24, c30);
+    _mm256_store_pd(tile + 28, c31);
+    _mm256_store_pd(tile + 32, c40);
+    _mm256_store_pd(tile + 36, c41);
+    _mm256_store_pd(tile + 40, c50);
+    _mm256_store_pd(tile + 44, c51);
+
+    if (mr != GEMM_MR || nr != GEMM_NR) {
+        StoreTile(tile, c, ldc, mr, nr, beta);
+        return;
+    }
+
+    for (std::size_t i = 0; i < GEMM_MR; i++) {
+        double *row = c + i * ldc;
+        __m256d lo = _mm256_load_pd(tile + i * GEMM_NR);
+        __m256d hi = _mm256_load_pd(tile + i * GEMM_NR + 4);
+        if (beta != 0) {
+            const __m256d scale = _mm256_set1_pd(beta);
+            lo = _mm256_fmadd_pd(scale, _mm256_loadu_pd(row), lo);
+            hi = _mm256_fmadd_pd(scale, _mm256_loadu_pd(row + 4), hi);
+        }
+        _mm256_storeu_pd(row, lo);
+        _mm256_storeu_pd(row + 4, hi);
+    }
+}
+
+inline bool CpuHasAvx2() {
+    static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has;
+}
+#endif
+
+template<typename T>
+GemmKernel<T> SelectGemmKernel() {
+    return GemmKernelPortable<T>;
+}
+
+template<>
+inline GemmKernel<double> SelectGemmKernel<double>() {
+#ifdef GEMM_HAVE_AVX2
+    if (CpuHasAvx2())
+        return GemmKernelAvx2;
+#endif
+    return GemmKernelPortable<double>;
+}
+
+// y[0:n] += alpha * x[0:n], the inner step of the sparse times dense
+// products: one stored entry scales a whole dense row.
+template<typename T>
+using AxpyKernel = void (*)(std::size_t n, const T& alpha, const T *x, T *y);
+
+template<typename T>
+void AxpyPortable(std::size_t n, const T& alpha, const T *x, T *y) {
+    for (std::size_t i = 0; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+#ifdef GEMM_HAVE_AVX2
+__attribute__((target("avx2,fma")))
+inline void AxpyAvx2(std::size_t n, const double& alpha, const double *x, double *y) {
+    const __m256d scale = _mm256_set1_pd(alpha);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(scale, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        _mm256_storeu_pd(y + i + 4,
+                         _mm256_fmadd_pd(scale, _mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(scale, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+#endif
+
+template<typename T>
+AxpyKernel<T> SelectAxpyKernel() {
+    return AxpyPortable<T>;
+}
+
+template<>
+inline AxpyKernel<double> SelectAxpyKernel<double>() {
+#ifdef GEMM_HAVE_AVX2
+    if (CpuHasAvx2())
+        return AxpyAvx2;
+#endif
+    return AxpyPortable<double>;
+}
+
+// f(0) .. f(tasks - 1), on the pool if parallel.
+template<typename F>
+void GemmRun(ThreadPool& pool, bool parallel, std::size_t tasks, F&& f) {
+    if (parallel) {
+        pool.Run(tasks, f);
+        return;
+    }
+
+    for (std::size_t task = 0; task < tasks; task++) {
+        f(task);
+    }
+}
+
+} // namespace detail
+
+// C = alpha * A * B + beta * C for row-major A (m x k), B (k x n) and
+// C (m x n) whose rows are lda, ldb and ldc cells apart. A zero beta
+// ignores the old values of C.
+template<typename T>
+void DenseGemm(std::size_t m, std::size_t n, std::size_t k, const T& alpha,
+               const T *a, std::size_t lda, const T *b, std::size_t ldb,
+               const T& beta, T *c, std::size_t ldc, ThreadPool& pool) {
+    if (k == 0 || alpha == T()) {
+        for (std::size_t i = 0; i < m; i++) {
+            for (std::size_t j = 0; j < n; j++) {
+                c[i * ldc + j] = detail::GemmScaled(beta, c[i * ldc + j]);
+            }
+        }
+        return;
+    }
+
+    if (m == 0 || n == 0)
+        return;
+
+    const detail::GemmKernel<T> kernel = detail::SelectGemmKernel<T>();
+    const auto round_up = [](std::size_t size, std::size_t block) {
+        return (size + block - 1) / block * block;
+    };
+
+    const bool parallel = pool.Threads() > 1
+        && 2.0 * m * n * k >= static_cast<double>(GEMM_PARALLEL_MIN_FLOPS);
+    const std::size_t m_blocks = (m + GEMM_MC - 1) / GEMM_MC;
+
+    detail::GemmBuffer<T> packed_a(round_up(m, GEMM_MR) * std::min(k, GEMM_KC));
+    detail::GemmBuffer<T> packed_b(round_up(std::min(n, GEMM_NC), GEMM_NR) * std::min(k, GEMM_KC));
+
+    for (std::size_t jc = 0; jc < n; jc += GEMM_NC) {
+        const std::size_t nc = std::min(GEMM_NC, n - jc);
+
+        // Column groups of whole slivers, a few tasks per thread in all.
+        const std::size_t slivers = (nc + GEMM_NR - 1) / GEMM_NR;
+        const std::size_t wanted = parallel ? (pool.Threads() * 4 + m_blocks - 1) / m_blocks : 1;
+        const std::size_t group_width = (slivers + std::min(slivers, wanted) - 1)
+                                      / std::min(slivers, wanted) * GEMM_NR;
+        const std::size_t groups = (nc + group_width - 1) / group_width;
+
+        for (std::size_t pc = 0; pc < k; pc += GEMM_KC) {
+            const std::size_t kc = std::min(GEMM_KC, k - pc);
+            // Only the first pass over k scales the old C.
+            const T step_beta = pc == 0 ? beta : T(1);
+
+            detail::GemmRun(pool, parallel, m_blocks + groups, [&](std::size_t task) {
+                if (task < m_blocks) {
+                    const std::size_t ic = task * GEMM_MC;
+                    detail::PackA(std::min(GEMM_MC, m - ic), kc, a + ic * lda + pc, lda, alpha,
+                                  packed_a.data() + ic * kc);
+                } else {
+                    const std::size_t jr = (task - m_blocks) * group_width;
+                    detail::PackB(kc, std::min(group_width, nc - jr), b + pc * ldb + jc + jr, ldb,
+                                  packed_b.data() + jr * kc);
+                }
+            });
+
+            detail::GemmRun(pool, parallel, m_blocks * groups, [&](std::size_t task) {
+                const std::size_t ic = task % m_blocks * GEMM_MC;
+                const std::size_t mc = std::min(GEMM_MC, m - ic);
+                const std::size_t group_begin = task / m_blocks * group_width;
+                const std::size_t group_end = std::min(nc, group_begin + group_width);
+
+                for (std::size_t jr = group_begin; jr < group_end; jr += GEMM_NR) {
+                    for (std::size_t ir = 0; ir < mc; ir += GEMM_MR) {
+                        kernel(kc, packed_a.data() + (ic + ir) * kc, packed_b.data() + jr * kc,
+                               c + (ic + ir) * ldc + jc + jr, ldc,
+                               std::min(GEMM_MR, mc - ir), std::min(GEMM_NR, nc - jr), step_beta);
+                    }
+                }
+            });
+        }
+    }
+}
+
+#endif
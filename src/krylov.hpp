@@ -0,0 +1,365 @@
+#ifndef _KRYLOV_H_
+#define _KRYLOV_H_
+
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include "smatrix.hpp"
+
+constexpr char SOLVER_INVALID_RHS    [] = "Right hand side or initial guess has invalid size";
+constexpr char SOLVER_INVALID_RESTART[] = "GMRES restart length must be positive";
+
+// Stopping rules shared by the iterative solvers. The residual is relative,
+// ||b - A * x|| / ||b||. The callback is called after every iteration with
+// its number (from 1) and the residual; returning false stops the solver.
+struct SolverOptions {
+    double tolerance = 1e-10;
+    std::size_t max_iterations = 1000;
+    // Krylov subspace size of GMRES before it restarts.
+    std::size_t restart = 30;
+    std::function<bool(std::size_t, double)> callback;
+};
+
+struct SolverResult {
+    bool converged = false;
+    std::size_t iterations = 0;
+    double residual = 0;
+};
+
+// Applies no preconditioning, z = r.
+struct IdentityPreconditioner {
+    template<typename T>
+    void Apply(const std::vector<T>& r, std::vector<T>& z) const {
+        z = r;
+    }
+};
+
+namespace detail {
+
+template<typename T>
+T Dot(const std::vector<T>& lhs, const std::vector<T>& rhs) {
+    T sum = T();
+    for (std::size_t i = 0; i < lhs.size(); i++) {
+        sum += lhs[i] * rhs[i];
+    }
+
+    return sum;
+}
+
+template<typename T>
+double Norm(const std::vector<T>& vec) {
+    return std::sqrt(std::abs(Dot(vec, vec)));
+}
+
+// y += alpha * x
+template<typename T>
+void Axpy(T alpha, const std::vector<T>& x, std::vector<T>& y) {
+    for (std::size_t i = 0; i < y.size(); i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+// Checks the sizes, starts from zero if x is empty and returns b - A * x.
+template<typename T>
+std::vector<T> StartSolve(const SparseMatrixBase<T>& a, const std::vector<T>& b,
+                          std::vector<T>& x, ThreadPool& pool) {
+    if (!a.IsSquare()) {
+        throw std::invalid_argument(MATRIX_MUST_BE_SQUARE);
+    }
+
+    if (b.size() != a.Rows() || (!x.empty() && x.size() != a.Cols())) {
+        throw std::invalid_argument(SOLVER_INVALID_RHS);
+    }
+
+    x.resize(a.Cols());
+
+    std::vector<T> r;
+    a.Multiply(x, r, pool);
+    for (std::size_t i = 0; i < r.size(); i++) {
+        r[i] = b[i] - r[i];
+    }
+
+    return r;
+}
+
+// Records an iteration, returns true if the solver has to stop.
+inline bool Report(SolverResult& result, const SolverOptions& options, double residual) {
+    result.iterations++;
+    result.residual = residual;
+    result.converged = residual <= options.tolerance;
+
+    const bool proceed = !options.callback || options.callback(result.iterations, residual);
+    return result.converged || !proceed;
+}
+
+} // namespace detail
+
+// Preconditioned conjugate gradient for symmetric positive definite A.
+// x holds the initial guess (empty means zero) and receives the solution.
+// Every iteration costs one product with A and one application of M.
+template<typename T, typename Preconditioner = IdentityPreconditioner>
+SolverResult ConjugateGradient(const SparseMatrixBase<T>& a, const std::vector<T>& b,
+                               std::vector<T>& x, const SolverOptions& options = SolverOptions(),
+                               const Preconditioner& precond = Preconditioner(),
+                               ThreadPool& pool = DefaultThreadPool()) {
+    std::vector<T> r = detail::StartSolve(a, b, x, pool);
+
+    SolverResult result;
+    const double norm_b = detail::Norm(b);
+    if (norm_b == 0) {
+        std::fill(x.begin(), x.end(), 0);
+        result.converged = true;
+        return result;
+    }
+
+    result.residual = detail::Norm(r) / norm_b;
+    if (result.residual <= options.tolerance) {
+        result.converged = true;
+        return result;
+    }
+
+    std::vector<T> z;
+    precond.Apply(r, z);
+    std::vector<T> p = z;
+    std::vector<T> ap;
+    T rz = detail::Dot(r, z);
+
+    while (result.iterations < options.max_iterations) {
+        a.Multiply(p, ap, pool);
+
+        const T pap = detail::Dot(p, ap);
+        if (pap == T())
+            break;
+
+        const T alpha = rz / pap;
+        detail::Axpy(alpha, p, x);
+        detail::Axpy(-alpha, ap, r);
+
+        if (detail::Report(result, options, detail::Norm(r) / norm_b))
+            break;
+
+        precond.Apply(r, z);
+        const T rz_next = detail::Dot(r, z);
+        const T beta = rz_next / rz;
+        rz = rz_next;
+
+        for (std::size_t i = 0; i < p.size(); i++) {
+            p[i] = z[i] + beta * p[i];
+        }
+    }
+
+    return result;
+}
+
+// Right preconditioned BiCGSTAB for general square A. Every iteration costs
+// two products with A and two applications of M.
+template<typename T, typename Preconditioner = IdentityPreconditioner>
+SolverResult BiCGStab(const SparseMatrixBase<T>& a, const std::vector<T>& b,
+                      std::vector<T>& x, const SolverOptions& options = SolverOptions(),
+                      const Preconditioner& precond = Preconditioner(),
+                      ThreadPool& pool = DefaultThreadPool()) {
+    std::vector<T> r = detail::StartSolve(a, b, x, pool);
+
+    SolverResult result;
+    const double norm_b = detail::Norm(b);
+    if (norm_b == 0) {
+        std::fill(x.begin(), x.end(), 0);
+        result.converged = true;
+        return result;
+    }
+
+    result.residual = detail::Norm(r) / norm_b;
+    if (result.residual <= options.tolerance) {
+        result.converged = true;
+        return result;
+    }
+
+    const std::vector<T> r_hat = r;
+    std::vector<T> p(r.size());
+    std::vector<T> v(r.size());
+    std::vector<T> s(r.size());
+    std::vector<T> t;
+    std::vector<T> p_hat;
+    std::vector<T> s_hat;
+
+    T rho = 1;
+    T alpha = 1;
+    T omega = 1;
+
+    while (result.iterations < options.max_iterations) {
+        const T rho_next = detail::Dot(r_hat, r);
+        if (rho_next == T())
+            break;
+
+        const T beta = (rho_next / rho) * (alpha / omega);
+        rho = rho_next;
+        for (std::size_t i = 0; i < p.size(); i++) {
+            p[i] = r[i] + beta * (p[i] - omega * v[i]);
+        }
+
+        precond.Apply(p, p_hat);
+        a.Multiply(p_hat, v, pool);
+
+        const T r_hat_v = detail::Dot(r_hat, v);
+        if (r_hat_v == T())
+            break;
+
+        alpha = rho / r_hat_v;
+        for (std::size_t i = 0; i < s.size(); i++) {
+            s[i] = r[i] - alpha * v[i];
+        }
+
+        const double s_residual = detail::Norm(s) / norm_b;
+        if (s_residual <= options.tolerance) {
+            detail::Axpy(alpha, p_hat, x);
+            detail::Report(result, options, s_residual);
+            break;
+        }
+
+        precond.Apply(s, s_hat);
+        a.Multiply(s_hat, t, pool);
+
+        const T tt = detail::Dot(t, t);
+        omega = tt == T() ? T() : detail::Dot(t, s) / tt;
+
+        detail::Axpy(alpha, p_hat, x);
+        detail::Axpy(omega, s_hat, x);
+        for (std::size_t i = 0; i < r.size(); i++) {
+            r[i] = s[i] - omega * t[i];
+        }
+
+        if (detail::Report(result, options, detail::Norm(r) / norm_b) || omega == T())
+            break;
+    }
+
+    return result;
+}
+
+// Right preconditioned GMRES restarted every options.restart iterations.
+// Keeps restart + 1 basis vectors; the residual comes from the Givens
+// rotated Hessenberg matrix, so it costs nothing extra per iteration.
+template<typename T, typename Preconditioner = IdentityPreconditioner>
+SolverResult Gmres(const SparseMatrixBase<T>& a, const std::vector<T>& b,
+                   std::vector<T>& x, const SolverOptions& options = SolverOptions(),
+                   const Preconditioner& precond = Preconditioner(),
+                   ThreadPool& pool = DefaultThreadPool()) {
+    if (options.restart == 0) {
+        throw std::invalid_argument(SOLVER_INVALID_RESTART);
+    }
+
+    std::vector<T> r = detail::StartSolve(a, b, x, pool);
+
+    SolverResult result;
+    const double norm_b = detail::Norm(b);
+    if (norm_b == 0) {
+        std::fill(x.begin(), x.end(), 0);
+        result.converged = true;
+        return result;
+    }
+
+    const std::size_t m = options.restart;
+    std::vector<std::vector<T>> basis(m + 1);
+    // Column j of the Hessenberg matrix, rotated to upper triangular.
+    std::vector<std::vector<T>> h(m, std::vector<T>(m + 1));
+    std::vector<T> cs(m);
+    std::vector<T> sn(m);
+    std::vector<T> g(m + 1);
+    std::vector<T> z;
+    std::vector<T> w;
+
+    bool stop = false;
+    while (!stop) {
+        const double beta = detail::Norm(r);
+        result.residual = beta / norm_b;
+        if (result.residual <= options.tolerance) {
+            result.converged = true;
+            break;
+        }
+
+        if (result.iterations >= options.max_iterations)
+            break;
+
+        basis[0] = r;
+        for (T& value : basis[0]) {
+            value /= beta;
+        }
+
+        std::fill(g.begin(), g.end(), 0);
+        g[0] = beta;
+
+        std::size_t k = 0;
+        while (k < m && result.iterations < options.max_iterations) {
+            precond.Apply(basis[k], z);
+            a.Multiply(z, w, pool);
+
+            // Modified Gram-Schmidt.
+            std::vector<T>& col = h[k];
+            for (std::size_t i = 0; i <= k; i++) {
+                col[i] = detail::Dot(w, basis[i]);
+                detail::Axpy(-col[i], basis[i], w);
+            }
+            col[k + 1] = detail::Norm(w);
+
+            const T next_norm = col[k + 1];
+            if (next_norm != T()) {
+                basis[k + 1] = w;
+                for (T& value : basis[k + 1]) {
+                    value /= next_norm;
+                }
+            }
+
+            for (std::size_t i = 0; i < k; i++) {
+                const T upper = col[i];
+                col[i] = cs[i] * upper + sn[i] * col[i + 1];
+                col[i + 1] = -sn[i] * upper + cs[i] * col[i + 1];
+            }
+
+            const T radius = std::hypot(col[k], col[k + 1]);
+            cs[k] = radius == T() ? T(1) : col[k] / radius;
+            sn[k] = radius == T() ? T() : col[k + 1] / radius;
+            col[k] = radius;
+            col[k + 1] = 0;
+
+            g[k + 1] = -sn[k] * g[k];
+            g[k] = cs[k] * g[k];
+            k++;
+
+            stop = detail::Report(result, options, std::abs(g[k]) / norm_b);
+            if (stop || next_norm == T())
+                break;
+        }
+
+        // x += M * (V * y) with H * y = g, H upper triangular.
+        std::vector<T> y(k);
+        for (std::size_t i = k; i-- > 0;) {
+            T sum = g[i];
+            for (std::size_t j = i + 1; j < k; j++) {
+                sum -= h[j][i] * y[j];
+            }
+            y[i] = h[i][i] == T() ? T() : sum / h[i][i];
+        }
+
+        std::vector<T> update(x.size());
+        for (std::size_t i = 0; i < k; i++) {
+            detail::Axpy(y[i], basis[i], update);
+        }
+
+        precond.Apply(update, z);
+        detail::Axpy(T(1), z, x);
+
+        if (stop)
+            break;
+
+        a.Multiply(x, r, pool);
+        for (std::size_t i = 0; i < r.size(); i++) {
+            r[i] = b[i] - r[i];
+        }
+    }
+
+    return result;
+}
+
+#endif
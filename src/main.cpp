@@ -3,6 +3,12 @@
 #include "iostream"
 #include "cassert"
 #include "chrono"
+#include "sstream"
+#include "cstdint"
+#include "atomic"
+#include "cmath"
+#include "limits"
+#include "string"
 
 #define TEST_LABEL_VAR_NAME __test_label__
 
@@ -36,6 +42,18 @@ void SmatrixTest() {
 
         assert(mat3 == mat4);
 
+        // Cells are compared, not storage: a missing entry is the offset.
+        SparseMatrixBase<double> shifted(2, 2);
+        shifted.Shift(1);
+        SparseMatrixBase<double> ones = { { 1, 1 }, { 1, 1 } };
+        assert(shifted == ones && ones == shifted);
+        assert(SparseMatrix(shifted) == SparseMatrix(ones));
+
+        shifted.Set(0, 0, 3);
+        assert(shifted == SparseMatrixBase<double>({ { 3, 1 }, { 1, 1 } }));
+        assert(shifted != SparseMatrixBase<double>({ { 3, 1 }, { 1, 2 } }));
+        assert(shifted != SparseMatrixBase<double>({ { 3, 1 }, { 0, 0 } }));
+
         END_TEST;
     }
 
@@ -81,6 +99,30 @@ void SmatrixTest() {
         END_TEST;
     }
 
+    TEST(smatrix sparse sum and diff) {
+        const std::size_t n = 1000000;
+        SparseMatrix mat1(n, n);
+        SparseMatrix mat2(n, n);
+
+        mat1.Set(0, 0, 1);
+        mat1.Set(5, n - 1, 2);
+        mat2.Set(5, n - 1, 2);
+        mat2.Set(n - 1, 3, 4);
+
+        SparseMatrix sum = mat1 + mat2;
+        assert(sum.IsCompressed());
+        assert(sum.RealSize() == 3);
+        assert(sum.Get(5, n - 1) == 4);
+        assert(sum.Get(n - 1, 3) == 4);
+
+        SparseMatrix diff = mat1 - mat2;
+        assert(diff.RealSize() == 2);
+        assert(diff.Get(5, n - 1) == 0);
+        assert(diff.Get(n - 1, 3) == -4);
+
+        END_TEST;
+    }
+
     TEST(smatrix multiplication) {
         SparseMatrix mat1 = {
             { 3, 2 },
@@ -104,6 +146,535 @@ void SmatrixTest() {
         END_TEST;
     }
 
+    TEST(smatrix large sparse multiplication) {
+        const std::size_t n = 100000;
+        SparseMatrixBuilder<double> builder1(n, n);
+        SparseMatrixBuilder<double> builder2(n, n);
+
+        for (std::size_t i = 0; i < n; i++) {
+            builder1.Add(i, i, 2);
+            builder1.Add(i, (i + 1) % n, 1);
+            builder2.Add(i, (i * 7) % n, 3);
+        }
+
+        SparseMatrix mat1 = builder1.Build();
+        SparseMatrix mat2 = builder2.Build();
+
+        auto start = std::chrono::high_resolution_clock::now();
+        SparseMatrix result = mat1 * mat2;
+        auto end = std::chrono::high_resolution_clock::now();
+
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+        std::cout << "Sparse " << n << "x" << n << " multiplication took "
+                  << duration.count() << " milliseconds." << std::endl;
+
+        assert(result.RealSize() == 2 * n);
+        for (std::size_t i = 0; i < n; i += 997) {
+            assert(result.Get(i, (i * 7) % n) == 6);
+            assert(result.Get(i, ((i + 1) % n * 7) % n) == 3);
+        }
+
+        END_TEST;
+    }
+
+    TEST(thread pool work stealing) {
+        const std::size_t tasks = 1000;
+        for (std::size_t threads : { 1, 3, 8 }) {
+            ThreadPool pool(threads);
+            std::vector<std::atomic<int>> runs(tasks);
+            std::vector<std::size_t> order;
+
+            // The first tasks are much heavier, the threads that own the
+            // light ones have to steal them.
+            pool.Run(tasks, [&](std::size_t task) {
+                volatile double sink = 0;
+                for (std::size_t i = 0; i < (task < 50 ? 200000 : 10); i++) {
+                    sink = sink + i;
+                }
+                runs[task]++;
+                if (threads == 1)
+                    order.push_back(task);
+            });
+
+            for (const auto& count : runs) {
+                assert(count == 1);
+            }
+
+            if (threads == 1) {
+                for (std::size_t i = 0; i < tasks; i++) {
+                    assert(order[i] == i);
+                }
+            }
+
+            bool thrown = false;
+            try {
+                pool.Run(10, [](std::size_t task) {
+                    if (task == 7)
+                        throw std::runtime_error("task failed");
+                });
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            assert(thrown);
+        }
+
+        END_TEST;
+    }
+
+    TEST(smatrix parallel multiplication) {
+        const std::size_t n = 2000;
+        SparseMatrixBuilder<double> builder1(n, n);
+        SparseMatrixBuilder<double> builder2(n, n);
+
+        for (std::size_t i = 0; i < n; i++) {
+            for (std::size_t j = 0; j < n; j += 1 + i % 200) {
+                builder1.Add(i, (j * 17 + i) % n, 1.0 + j % 3);
+            }
+            builder2.Add(i, i, 2);
+            builder2.Add(i, (i * 11) % n, -1);
+            builder2.Add(i, (i + 3) % n, 0.5);
+        }
+
+        SparseMatrix mat1 = builder1.Build();
+        SparseMatrix mat2 = builder2.Build();
+
+        ThreadPool serial(1);
+        SparseMatrix expected = mat1.Multiply(mat2, serial);
+
+        for (std::size_t threads : { 2, 4, 9 }) {
+            ThreadPool pool(threads);
+            SparseMatrix result = mat1.Multiply(mat2, pool);
+            assert(result.Csr().row_ptr == expected.Csr().row_ptr);
+            assert(result.Csr().col_idx == expected.Csr().col_idx);
+            assert(result.Csr().values == expected.Csr().values);
+        }
+
+        END_TEST;
+    }
+
+    TEST(smatrix fused multiply-add) {
+        SparseMatrix a = {
+            { 1, 0, 2 },
+            { 0, 3, 0 },
+        };
+
+        SparseMatrix b = {
+            { 2, 1 },
+            { 0, 1 },
+            { 1, 0 },
+        };
+
+        SparseMatrix c = {
+            { 1, 1 },
+            { 0, 5 },
+        };
+        c.Compress();
+
+        SparseMatrix expected = SparseMatrix(a * b) * 2.0 + c * 3.0;
+        const double *storage = c.Csr().values.data();
+        a.MultiplyAdd(2, b, 3, c);
+        assert(c == expected);
+        assert(c.Csr().values.data() == storage);
+
+        SparseMatrix grown = {
+            { 0, 0 },
+            { 4, 0 },
+        };
+        expected = SparseMatrix(a * b) - grown;
+        a.MultiplyAdd(1, b, -1, grown);
+        assert(grown == expected);
+
+        SparseMatrix cleared = { { 7, 7 }, { 7, 7 } };
+        a.MultiplyAdd(1, b, 0, cleared);
+        assert(cleared == SparseMatrix(a * b));
+
+        SparseMatrix shifted = a;
+        shifted.Shift(1);
+        SparseMatrix target = c;
+        expected = SparseMatrix(shifted * b) * 0.5 + c;
+        shifted.MultiplyAdd(0.5, b, 1, target);
+        assert(target == expected);
+
+        VectorMatrix<double> dense(2, 2);
+        dense.Set(0, 0, 1);
+        dense.Set(1, 1, -1);
+        expected = SparseMatrix(shifted * b) * 2.0;
+        shifted.MultiplyAdd(2, b, 1, dense);
+        assert(dense.Get(0, 0) == expected.Get(0, 0) + 1);
+        assert(dense.Get(0, 1) == expected.Get(0, 1));
+        assert(dense.Get(1, 0) == expected.Get(1, 0));
+        assert(dense.Get(1, 1) == expected.Get(1, 1) - 1);
+
+        const std::size_t n = 2000;
+        SparseMatrixBuilder<double> builder(n, n);
+        for (std::size_t i = 0; i < n; i++) {
+            for (std::size_t j = 0; j < n; j += 1 + i % 50) {
+                builder.Add(i, (j * 13 + i) % n, 1.0 + j % 3);
+            }
+        }
+        SparseMatrix big = builder.Build();
+
+        ThreadPool pool(4);
+        SparseMatrix square = big.Multiply(big, pool);
+        SparseMatrix accumulated = square;
+        big.MultiplyAdd(1, big, 1, accumulated, pool);
+        assert(accumulated == SparseMatrix(square * 2.0));
+
+        SparseMatrix partial = big;
+        big.MultiplyAdd(-1, big, 2, partial, pool);
+        assert(partial == SparseMatrix(big * 2.0 - square));
+
+        END_TEST;
+    }
+
+    TEST(smatrix dense products) {
+        const std::size_t rows = 300, inner = 200, vectors = 37;
+        SparseMatrixBuilder<double> builder(rows, inner);
+        for (std::size_t i = 0; i < rows; i++) {
+            for (std::size_t j = i % 5; j < inner; j += 7 + i % 11) {
+                builder.Add(i, j, 1.0 + (i + j) % 4);
+            }
+        }
+        SparseMatrix sparse = builder.Build();
+
+        VectorMatrix<double> right(inner, vectors);
+        VectorMatrix<double> left(vectors, rows);
+        for (std::size_t i = 0; i < inner; i++) {
+            for (std::size_t j = 0; j < vectors; j++) {
+                right.Set(i, j, (i * 3 + j) % 5 - 2.0);
+            }
+        }
+        for (std::size_t i = 0; i < vectors; i++) {
+            for (std::size_t j = 0; j < rows; j++) {
+                left.Set(i, j, (i + j * 7) % 3 - 1.0);
+            }
+        }
+
+        for (double shift : { 0.0, 2.0 }) {
+            SparseMatrix mat = sparse;
+            mat.Shift(shift);
+
+            VectorMatrix<double> expected_right(rows, vectors);
+            for (std::size_t i = 0; i < rows; i++) {
+                for (std::size_t j = 0; j < vectors; j++) {
+                    double sum = 0;
+                    for (std::size_t k = 0; k < inner; k++) {
+                        sum += mat.Get(i, k) * right.Get(k, j);
+                    }
+                    expected_right.Set(i, j, sum);
+                }
+            }
+
+            VectorMatrix<double> expected_left(vectors, inner);
+            for (std::size_t i = 0; i < vectors; i++) {
+                for (std::size_t j = 0; j < inner; j++) {
+                    double sum = 0;
+                    for (std::size_t k = 0; k < rows; k++) {
+                        sum += left.Get(i, k) * mat.Get(k, j);
+                    }
+                    expected_left.Set(i, j, sum);
+                }
+            }
+
+            assert(mat * right == expected_right);
+            assert(left * mat == expected_left);
+
+            for (std::size_t threads : { 1, 3, 8 }) {
+                ThreadPool pool(threads);
+                assert(mat.Multiply(right, pool) == expected_right);
+                assert(Multiply(left, mat, pool) == expected_left);
+            }
+
+            VectorMatrix<double> accumulated = expected_right;
+            mat.MultiplyAdd(2, right, -1, accumulated);
+            assert(accumulated == expected_right);
+
+            accumulated = expected_left;
+            MultiplyAdd(-1.0, left, mat, 2.0, accumulated);
+            assert(accumulated == expected_left);
+        }
+
+        bool thrown = false;
+        try {
+            sparse * left;
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        END_TEST;
+    }
+
+    TEST(smatrix semiring products) {
+        const double inf = std::numeric_limits<double>::infinity();
+
+        // Edge lengths of a small directed graph.
+        SparseMatrix graph = {
+            { 0, 4, 1, 0 },
+            { 0, 0, 0, 1 },
+            { 0, 2, 0, 6 },
+            { 3, 0, 0, 0 },
+        };
+
+        // Cells without a path are infinite, not 0.
+        SemiringMatrix<MinPlus<double>> two_steps = graph.Multiply<MinPlus<double>>(graph);
+        assert(two_steps.Get(0, 0) == inf);
+        assert(two_steps.Get(0, 1) == 3);
+        assert(two_steps.Get(0, 3) == 5);
+        assert(two_steps.Get(2, 3) == 3);
+        assert(two_steps.Get(3, 1) == 7);
+        assert(two_steps.Get(1, 0) == 4);
+        assert(two_steps.Get(3, 2) == 4);
+        assert(two_steps.RealSize() == 7);
+
+        const SemiringMatrix<MinPlus<double>> edges(graph);
+        SemiringMatrix<MinPlus<double>> three_steps = two_steps.Multiply(edges);
+        assert(three_steps == edges.Multiply(two_steps));
+        assert(three_steps.Get(0, 0) == 8);
+
+        // A zero length path is stored, an infinite edge is not.
+        SparseMatrix cycle = {
+            {  0, 2 },
+            { -2, 0 },
+        };
+        SemiringMatrix<MinPlus<double>> loops = cycle.Multiply<MinPlus<double>>(cycle);
+        assert(loops.RealSize() == 2);
+        assert(loops.Get(0, 0) == 0 && loops.Get(1, 1) == 0);
+        assert(loops.Get(0, 1) == inf);
+
+        SemiringMatrix<MinPlus<double>> zero_edge(2, 2, { { 0, 2, 2 }, { 0, 1 }, { inf, 0.0 } });
+        assert(zero_edge.RealSize() == 1);
+        assert(zero_edge.Get(0, 1) == 0 && zero_edge.Get(0, 0) == inf);
+        assert(zero_edge.Multiply(std::vector<double>({ 5, 7 })) == std::vector<double>({ 7, inf }));
+
+        // Bellman-Ford from vertex 0 on the transposed graph: d = min(d, G^T d).
+        SparseMatrix incoming = graph.Transpose();
+        std::vector<double> dist = { 0, inf, inf, inf };
+        for (int step = 0; step < 3; step++) {
+            std::vector<double> relaxed = incoming.Multiply<MinPlus<double>>(dist);
+            for (std::size_t i = 0; i < dist.size(); i++) {
+                dist[i] = std::min(dist[i], relaxed[i]);
+            }
+        }
+        assert(dist == std::vector<double>({ 0, 3, 1, 4 }));
+
+        // Reachability closure by repeated squaring of I + G.
+        SemiringMatrix<OrAnd<double>> reach(SparseMatrix(MakeIdentityMatrix<double>(4)) + graph);
+        for (int step = 0; step < 2; step++) {
+            reach = reach.Multiply(reach);
+        }
+        assert(reach.RealSize() == 16);
+        for (const auto [row, col, value] : reach.NonZeros()) {
+            assert(value == 1);
+        }
+
+        SparseMatrix chance = {
+            { 0,   0.5, 0.5 },
+            { 0,   0,   0.8 },
+            { 0.1, 0,   0   },
+        };
+        SemiringMatrix<MaxTimes<double>> best = chance.Multiply<MaxTimes<double>>(chance);
+        assert(best.Get(0, 2) == 0.4);
+        assert(best.Get(0, 0) == 0.05);
+        assert(IsEqual(best.Get(1, 0), 0.08, SparseMatrix::EPSYLON));
+
+        const std::size_t n = 1500;
+        SparseMatrixBuilder<double> builder(n, n);
+        for (std::size_t i = 0; i < n; i++) {
+            for (std::size_t j = 1; j < 40; j += 1 + i % 5) {
+                builder.Add(i, (i * 17 + j * j) % n, 1.0 + (i + j) % 9);
+            }
+        }
+        SparseMatrix big = builder.Build();
+
+        assert(big.Multiply<PlusTimes<double>>(big) == SemiringMatrix<PlusTimes<double>>(big * big));
+
+        ThreadPool serial(1);
+        SemiringMatrix<MinPlus<double>> expected = big.Multiply<MinPlus<double>>(big, serial);
+        for (std::size_t threads : { 2, 5 }) {
+            ThreadPool pool(threads);
+            assert(big.Multiply<MinPlus<double>>(big, pool) == expected);
+        }
+
+        bool thrown = false;
+        try {
+            SparseMatrix shifted = graph;
+            shifted.Shift(1);
+            shifted.Multiply<MinPlus<double>>(graph);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        END_TEST;
+    }
+
+    TEST(smatrix compressed storage) {
+        SparseMatrix mat = {
+            { 1, 0, 2 },
+            { 0, 0, 3 },
+            { 4, 5, 0 }
+        };
+
+        SparseMatrix compressed = mat;
+        compressed.Compress();
+
+        assert(compressed.IsCompressed());
+        assert(compressed.RealSize() == 5);
+        assert(compressed.Csr().row_ptr == std::vector<std::size_t>({ 0, 2, 3, 5 }));
+        assert(compressed.Csr().col_idx == std::vector<std::size_t>({ 0, 2, 2, 0, 1 }));
+        assert(compressed.Get(2, 1) == 5);
+        assert(compressed.Get(1, 1) == 0);
+        assert(compressed == mat);
+
+        assert(SparseMatrix(compressed * mat) == SparseMatrix(mat * mat));
+        assert(SparseMatrix(compressed.Transpose()) == SparseMatrix(mat.Transpose()));
+
+        compressed.Set(1, 1, 7);
+        compressed.Set(0, 0, 0);
+        compressed.Set(2, 0, 6);
+        assert(compressed.IsCompressed());
+
+        SparseMatrix updated = {
+            { 0, 0, 2 },
+            { 0, 7, 3 },
+            { 6, 5, 0 }
+        };
+
+        assert(compressed == updated);
+
+        compressed.Uncompress();
+        assert(!compressed.IsCompressed());
+        assert(compressed == updated);
+
+        END_TEST;
+    }
+
+    TEST(flat sparse vector) {
+        FlatSparseVector<double> vec(10);
+        vec.Set(7, 3);
+        vec.Set(2, 1);
+        vec.Set(5, 2);
+        vec.Set(5, 0);
+        vec.PushBack(9, 4);
+
+        assert(vec.RealSize() == 3);
+        assert(vec.Indices() == std::vector<std::size_t>({ 2, 7, 9 }));
+        assert(vec.Get(7) == 3);
+        assert(vec.Get(5) == 0);
+        assert(vec.Has(9) && !vec.Has(8));
+        assert(vec.Find(7, 0) == 1);
+        assert(vec.Find(8, 1) == 2);
+        assert(vec.Find(10, 0) == 3);
+
+        FlatSparseVector<double> other = { 0, 0, 2, 0, 0, 0, 0, 1, 0, 0 };
+        assert(vec.Dot(other) == 5);
+
+        FlatSparseVector<double> sum = { 0, 0, 3, 0, 0, 0, 0, 4, 0, 4 };
+        assert(vec + other == sum);
+
+        FlatSparseVector<double> diff = { 0, 0, -1, 0, 0, 0, 0, 2, 0, 4 };
+        assert(vec - other == diff);
+
+        FlatSparseVector<double> wide(100000);
+        for (std::size_t i = 0; i < wide.size(); i += 3) {
+            wide.PushBack(i, 1);
+        }
+        FlatSparseVector<double> narrow(100000);
+        narrow.PushBack(3, 1);
+        narrow.PushBack(301, 5);
+        narrow.PushBack(99999, 2);
+        assert(narrow.Dot(wide) == 3);
+        assert(vec.Dot(FlatSparseVector<double>(10, 1)) == 8);
+
+        double dense_sum = 0;
+        for (const auto el : vec) {
+            dense_sum += el;
+        }
+        assert(dense_sum == 8);
+
+        END_TEST;
+    }
+
+    TEST(smatrix nonzero iteration) {
+        SparseVector<double> vec(1000000);
+        vec.Set(999999, 2);
+        vec.Set(10, 1);
+
+        std::size_t index_sum = 0;
+        double value_sum = 0;
+        for (const auto [index, value] : vec.NonZeros()) {
+            index_sum += index;
+            value_sum += value;
+        }
+        assert(index_sum == 1000009 && value_sum == 3);
+
+        SparseMatrix mat = {
+            { 0, 0, 0 },
+            { 1, 0, 2 },
+            { 0, 0, 0 },
+            { 0, 3, 0 }
+        };
+
+        for (int compressed = 0; compressed < 2; compressed++) {
+            if (compressed)
+                mat.Compress();
+
+            std::vector<std::size_t> rows;
+            std::vector<std::size_t> cols;
+            std::vector<double> values;
+            for (const auto [row, col, value] : mat.NonZeros()) {
+                rows.push_back(row);
+                cols.push_back(col);
+                values.push_back(value);
+            }
+
+            assert(rows == std::vector<std::size_t>({ 1, 1, 3 }));
+            assert(cols == std::vector<std::size_t>({ 0, 2, 1 }));
+            assert(values == std::vector<double>({ 1, 2, 3 }));
+            assert(mat.NonZeros(1).RealSize() == 2);
+            assert(mat.NonZeros(2).begin() == mat.NonZeros(2).end());
+        }
+
+        END_TEST;
+    }
+
+    TEST(smatrix builder) {
+        SparseMatrixBuilder<double> builder(3, 3);
+        builder.Add(2, 1, 5);
+        builder.Add(0, 2, 1);
+        builder.Add(0, 0, 1);
+        builder.Add(0, 2, 1);
+        builder.Add(1, 1, 4);
+
+        SparseMatrixBuilder<double> other(3, 3);
+        other.Add(1, 1, -4);
+        other.Add(2, 0, 4);
+        builder.Append(std::move(other));
+
+        SparseMatrix expected_sum = {
+            { 1, 0, 2 },
+            { 0, 0, 0 },
+            { 4, 5, 0 }
+        };
+
+        SparseMatrix sum = builder.Build();
+        assert(sum.IsCompressed());
+        assert(sum.RealSize() == 4);
+        assert(sum == expected_sum);
+
+        SparseMatrix expected_max = {
+            { 1, 0, 1 },
+            { 0, 4, 0 },
+            { 4, 5, 0 }
+        };
+
+        auto max = [](double lhs, double rhs) { return std::max(lhs, rhs); };
+        assert(SparseMatrix(builder.Build(max)) == expected_max);
+
+        END_TEST;
+    }
+
     TEST(smatrix-vector multiplication) {
         SparseMatrix mat = {
             { 1, -1, 2 },
@@ -119,6 +690,61 @@ void SmatrixTest() {
 
         assert((mat * vec) == result);
 
+        std::vector<double> dense = { 2, 1, 0 };
+        assert((mat * dense) == std::vector<double>({ 1, -3 }));
+
+        FlatSparseVector<double> flat = { 2, 1, 0 };
+        FlatSparseVector<double> flat_result = { 1, -3 };
+        assert((mat * flat) == flat_result);
+
+        std::vector<double> out(2, 42);
+        mat.Multiply(flat, out);
+        assert(out == std::vector<double>({ 1, -3 }));
+
+        FlatSparseVector<double> sparse_out;
+        mat.Multiply(dense, sparse_out);
+        assert(sparse_out == flat_result);
+
+        FlatSparseVector<double> zero_result(2);
+        FlatSparseVector<double> orthogonal = { 0, 0, 0 };
+        assert((mat * orthogonal) == zero_result);
+
+        END_TEST;
+    }
+
+    TEST(smatrix parallel vector multiplication) {
+        const std::size_t n = 20000;
+        SparseMatrixBuilder<double> builder(n, n);
+
+        // Power-law row lengths: row i holds about n / (i + 1) entries.
+        for (std::size_t i = 0; i < n; i++) {
+            for (std::size_t j = 0; j < n; j += i + 1) {
+                builder.Add(i, (j * 31 + i) % n, 1.0 + (i + j) % 5);
+            }
+        }
+
+        SparseMatrix mat = builder.Build();
+
+        std::vector<double> x(n);
+        for (std::size_t i = 0; i < n; i++) {
+            x[i] = (i % 13) - 6.0;
+        }
+
+        std::vector<double> expected;
+        mat.Multiply(x, expected);
+
+        for (std::size_t threads : { 1, 2, 4, 7 }) {
+            ThreadPool pool(threads);
+            std::vector<double> result;
+            mat.Multiply(x, result, pool);
+            assert(result == expected);
+
+            mat.Uncompress();
+            mat.Multiply(x, result, pool);
+            assert(result == expected);
+            mat.Compress();
+        }
+
         END_TEST;
     }
 
@@ -129,7 +755,28 @@ void SmatrixTest() {
             { 7, 8, 9 },
         };
 
+        assert(IsEqual(mat1.Determinant(), 0, SparseMatrix::EPSYLON));
+        // Rounding leaves a tiny last pivot, it still counts as zero.
         assert(mat1.Determinant() == 0);
+        assert(!mat1.IsInversable());
+
+        // Pivots are measured against their own rows: a large off-diagonal
+        // entry or a small but exact determinant is not singular.
+        SparseMatrix skewed = {
+            { 1, 1e6 },
+            { 0, 1 },
+        };
+        assert(!SparseLU(skewed).IsSingular());
+        assert(skewed.Determinant() == 1);
+        assert(skewed.IsInversable());
+        assert(SparseMatrix(skewed * skewed.Inverse()) == SparseMatrix(MakeIdentityMatrix<double>(2)));
+
+        SparseMatrix close = {
+            { 1, 1 },
+            { 1, 1.000001 },
+        };
+        assert(std::abs(close.Determinant() - 1e-6) < 1e-12);
+        assert(close.IsInversable());
 
         SparseMatrix mat2 = {
             { 4,   3,   2,  2 },
@@ -138,7 +785,7 @@ void SmatrixTest() {
             { 0,   3,   1,  1 }
         };
 
-        assert(mat2.Determinant() == -240);
+        assert(IsEqual(mat2.Determinant(), -240, SparseMatrix::EPSYLON));
 
         SparseMatrix mat3 = {
             { 4, 5, 2, 5, 1 },
@@ -148,7 +795,103 @@ void SmatrixTest() {
             { 12, 1, 3, 4, 2}
         };
 
-        assert(mat3.Determinant() == 503);
+        assert(IsEqual(mat3.Determinant(), 503, SparseMatrix::EPSYLON));
+
+        END_TEST;
+    }
+
+    TEST(smatrix lu factorization) {
+        SparseMatrix mat = {
+            { 0, 2, 0, 1 },
+            { 3, 0, 0, 0 },
+            { 0, 1, 4, 0 },
+            { 1, 0, 2, 5 }
+        };
+
+        SparseLU lu(mat);
+        assert(!lu.IsSingular());
+        assert(IsEqual(lu.Determinant(), -126, SparseMatrix::EPSYLON));
+        assert(IsEqual(SparseLU(mat, 0.1).Determinant(), -126, SparseMatrix::EPSYLON));
+
+        for (double threshold : { 0.0, -1.0, 1.5 }) {
+            bool thrown = false;
+            try {
+                SparseLU wrong(mat, threshold);
+            } catch (const std::invalid_argument&) {
+                thrown = true;
+            }
+            assert(thrown);
+        }
+
+        SparseMatrix permuted(4, 4);
+        for (std::size_t k = 0; k < 4; k++) {
+            for (const auto [col, value] : mat.NonZeros(lu.Permutation()[k])) {
+                permuted.Set(k, col, value);
+            }
+        }
+        SparseMatrix identity = MakeIdentityMatrix<double>(4);
+        assert(SparseMatrix((lu.L() + identity) * lu.U()) == permuted);
+
+        std::vector<double> x = { 1, -2, 3, 0.5 };
+        std::vector<double> solution = lu.Solve(mat * x);
+        for (std::size_t i = 0; i < x.size(); i++) {
+            assert(IsEqual(solution[i], x[i], SparseMatrix::EPSYLON));
+        }
+
+        SparseMatrix rhs = {
+            { 2, 0 },
+            { 3, 0 },
+            { 5, 4 },
+            { 8, 0 }
+        };
+        assert(SparseMatrix(mat * lu.Solve(rhs)) == rhs);
+
+        // The offset of the right hand side is part of every column.
+        SparseMatrix shifted = rhs + 1.0;
+        assert(shifted.Offset() != 0);
+        assert(SparseMatrix(mat * lu.Solve(shifted)) == shifted);
+
+        SparseMatrix unit_rhs(2, 1);
+        unit_rhs.Shift(1);
+        SparseMatrix halves = SparseLU(SparseMatrix{ { 1, 0 }, { 0, 2 } }).Solve(unit_rhs);
+        assert(IsEqual(halves.Get(0, 0), 1, SparseMatrix::EPSYLON));
+        assert(IsEqual(halves.Get(1, 0), 0.5, SparseMatrix::EPSYLON));
+
+        // Same pattern, other values: pivots and patterns of L and U are reused.
+        SparseMatrix changed = {
+            { 0, 1, 0, 7 },
+            { 1, 0, 0, 0 },
+            { 0, 3, 2, 0 },
+            { 9, 0, 1, 1 }
+        };
+        lu.Refactor(changed);
+        assert(IsEqual(lu.Determinant(), SparseMatrix(changed.Transpose()).Determinant(), SparseMatrix::EPSYLON));
+        solution = lu.Solve(changed * x);
+        for (std::size_t i = 0; i < x.size(); i++) {
+            assert(IsEqual(solution[i], x[i], SparseMatrix::EPSYLON));
+        }
+
+        const std::size_t n = 2000;
+        SparseMatrixBuilder<double> builder(n, n);
+        for (std::size_t i = 0; i < n; i++) {
+            builder.Add(i, (i + 1) % n, 2);
+            builder.Add(i, (i * 37) % n, 1);
+        }
+
+        SparseMatrix large = builder.Build();
+        SparseLU large_lu(large, 0.1);
+        std::vector<double> ones(n, 1);
+        std::vector<double> large_solution = large_lu.Solve(large * ones);
+        for (std::size_t i = 0; i < n; i++) {
+            assert(IsEqual(large_solution[i], 1, SparseMatrix::EPSYLON));
+        }
+
+        SparseMatrix singular = {
+            { 1, 2 },
+            { 2, 4 }
+        };
+        assert(SparseLU(singular).IsSingular());
+        assert(singular.Determinant() == 0);
 
         END_TEST;
     }
@@ -185,6 +928,231 @@ void SmatrixTest() {
         auto inv = mat2.Inverse();
 
         assert(SparseMatrix(mat2 * inv) == identity);
+
+        // Zero leading diagonal needs pivoting.
+        SparseMatrix mat3 = {
+            { 0, 2, 0, 1 },
+            { 3, 0, 0, 0 },
+            { 0, 1, 4, 0 },
+            { 1, 0, 2, 5 }
+        };
+
+        ThreadPool pool(3);
+        SparseLU lu(mat3);
+        SparseMatrix inv3 = lu.Inverse(pool);
+        assert(SparseMatrix(mat3 * inv3) == SparseMatrix(MakeIdentityMatrix<double>(4)));
+        assert(inv3 == mat3.Inverse());
+
+        SparseMatrix cols = lu.InverseColumns({ 3, 0 });
+        assert(cols.Rows() == 4 && cols.Cols() == 2);
+        for (std::size_t i = 0; i < 4; i++) {
+            assert(IsEqual(cols.Get(i, 0), inv3.Get(i, 3), SparseMatrix::EPSYLON));
+            assert(IsEqual(cols.Get(i, 1), inv3.Get(i, 0), SparseMatrix::EPSYLON));
+            assert(IsEqual(lu.InverseEntry(i, 2), inv3.Get(i, 2), SparseMatrix::EPSYLON));
+        }
+
+        SparseMatrix singular = {
+            { 1, 2 },
+            { 2, 4 }
+        };
+        bool thrown = false;
+        try {
+            singular.Inverse();
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // Singular only up to rounding: the last pivot is about 1e-16.
+        SparseMatrix rounded = {
+            { 1, 2, 3 },
+            { 4, 5, 6 },
+            { 7, 8, 9 }
+        };
+        SparseLU rounded_lu(rounded);
+        assert(rounded_lu.IsSingular());
+
+        thrown = false;
+        try {
+            rounded.Inverse();
+        } catch (const std::invalid_argument& error) {
+            thrown = std::string(error.what()) == LU_SINGULAR;
+        }
+        assert(thrown);
+
+        thrown = false;
+        try {
+            rounded_lu.InverseColumns({ 1 }, pool);
+        } catch (const std::invalid_argument& error) {
+            thrown = std::string(error.what()) == LU_SINGULAR;
+        }
+        assert(thrown);
+
+        thrown = false;
+        try {
+            rounded_lu.InverseEntry(0, 0);
+        } catch (const std::invalid_argument& error) {
+            thrown = std::string(error.what()) == LU_SINGULAR;
+        }
+        assert(thrown);
+        END_TEST;
+    }
+
+    TEST(smatrix krylov solvers) {
+        const std::size_t n = 300;
+        SparseMatrixBuilder<double> laplace(n, n);
+        SparseMatrixBuilder<double> general(n, n);
+        for (std::size_t i = 0; i < n; i++) {
+            laplace.Add(i, i, 2);
+            general.Add(i, i, 4);
+            if (i > 0) {
+                laplace.Add(i, i - 1, -1);
+                general.Add(i, i - 1, -1);
+            }
+            if (i + 1 < n) {
+                laplace.Add(i, i + 1, -1);
+                general.Add(i, i + 1, -2);
+            }
+            general.Add(i, (i * 37) % n, 0.5);
+        }
+
+        SparseMatrix spd = laplace.Build();
+        SparseMatrix mat = general.Build();
+
+        std::vector<double> b(n);
+        for (std::size_t i = 0; i < n; i++) {
+            b[i] = 1.0 + i % 7;
+        }
+
+        auto residual = [&](const SparseMatrix& a, const std::vector<double>& x) {
+            std::vector<double> ax = a * x;
+            double norm = 0;
+            double norm_b = 0;
+            for (std::size_t i = 0; i < n; i++) {
+                norm += (b[i] - ax[i]) * (b[i] - ax[i]);
+                norm_b += b[i] * b[i];
+            }
+            return std::sqrt(norm / norm_b);
+        };
+
+        std::size_t calls = 0;
+        SolverOptions options;
+        options.callback = [&](std::size_t, double) { calls++; return true; };
+
+        std::vector<double> x;
+        SolverResult result = ConjugateGradient(spd, b, x, options);
+        assert(result.converged && calls == result.iterations);
+        assert(residual(spd, x) < 1e-9);
+
+        x.clear();
+        result = BiCGStab(mat, b, x, options);
+        assert(result.converged);
+        assert(residual(mat, x) < 1e-9);
+
+        options.restart = 10;
+        x.clear();
+        result = Gmres(mat, b, x, options);
+        assert(result.converged);
+        assert(residual(mat, x) < 1e-9);
+
+        // A warm start from the solution needs no iterations.
+        result = Gmres(mat, b, x, options);
+        assert(result.converged && result.iterations == 0);
+
+        options.callback = [](std::size_t iteration, double) { return iteration < 3; };
+        x.clear();
+        result = ConjugateGradient(spd, b, x, options);
+        assert(!result.converged && result.iterations == 3);
+
+        END_TEST;
+    }
+
+    TEST(smatrix preconditioners) {
+        // 5-point Laplacian on a grid with badly scaled rows.
+        const std::size_t side = 40;
+        const std::size_t n = side * side;
+        SparseMatrixBuilder<double> builder(n, n);
+        for (std::size_t i = 0; i < n; i++) {
+            const double scale = 1.0 + i % 50;
+            builder.Add(i, i, 4.5 * scale);
+            if (i % side > 0)
+                builder.Add(i, i - 1, -1 * scale);
+            if (i % side + 1 < side)
+                builder.Add(i, i + 1, -1.2 * scale);
+            if (i >= side)
+                builder.Add(i, i - side, -1 * scale);
+            if (i + side < n)
+                builder.Add(i, i + side, -0.8 * scale);
+        }
+        SparseMatrix mat = builder.Build();
+        std::vector<double> b(n, 1);
+
+        SolverOptions options;
+        options.max_iterations = 2000;
+
+        std::vector<double> x;
+        const SolverResult plain = Gmres(mat, b, x, options);
+        x.clear();
+        const SolverResult jacobi = Gmres(mat, b, x, options, JacobiPreconditioner(mat));
+        x.clear();
+        const SolverResult ilu = Gmres(mat, b, x, options, IncompleteLU(mat));
+        x.clear();
+        const SolverResult ilut = BiCGStab(mat, b, x, options, IncompleteLU(mat, SparseMatrix::EPSYLON));
+
+        assert(plain.converged && jacobi.converged && ilu.converged && ilut.converged);
+        assert(jacobi.iterations < plain.iterations);
+        assert(ilu.iterations < jacobi.iterations);
+        assert(ilut.iterations <= ilu.iterations);
+
+        // ILU(0) of a tridiagonal matrix is its exact LU factorization,
+        // and so is ILUT without dropping.
+        SparseMatrix tridiagonal = {
+            { 4, 1, 0, 0 },
+            { 2, 5, 1, 0 },
+            { 0, 1, 6, 2 },
+            { 0, 0, 3, 7 }
+        };
+        const std::vector<double> rhs = { 1, 2, 3, 4 };
+        for (const IncompleteLU& exact : { IncompleteLU(tridiagonal), IncompleteLU(tridiagonal, 0.0) }) {
+            assert(SparseMatrix(exact.L() + MakeIdentityMatrix<double>(4)) * exact.U() == tridiagonal);
+
+            std::vector<double> z;
+            exact.Apply(rhs, z);
+            const std::vector<double> back = tridiagonal * z;
+            for (std::size_t i = 0; i < 4; i++) {
+                assert(IsEqual(back[i], rhs[i], SparseMatrix::EPSYLON));
+            }
+        }
+
+        // Row i >= half depends only on row i - half: two wide levels that
+        // are solved in parallel.
+        const std::size_t wide = 20000;
+        SparseMatrixBuilder<double> levels(wide, wide);
+        for (std::size_t i = 0; i < wide; i++) {
+            levels.Add(i, i, 2 + i % 3);
+            if (i >= wide / 2)
+                levels.Add(i, i - wide / 2, 1);
+            else
+                levels.Add(i, i + wide / 2, 0.5);
+        }
+        SparseMatrix level_mat = levels.Build();
+
+        ThreadPool serial(1);
+        ThreadPool pool(4);
+        IncompleteLU serial_ilu(level_mat, serial);
+        IncompleteLU parallel_ilu(level_mat, pool);
+        assert(parallel_ilu.LowerLevels() == 2 && parallel_ilu.UpperLevels() == 2);
+
+        std::vector<double> r(wide);
+        for (std::size_t i = 0; i < wide; i++) {
+            r[i] = 1.0 + i % 11;
+        }
+        std::vector<double> z1;
+        std::vector<double> z2;
+        serial_ilu.Apply(r, z1);
+        parallel_ilu.Apply(r, z2);
+        assert(z1 == z2);
+
         END_TEST;
     }
 
@@ -205,6 +1173,31 @@ void SmatrixTest() {
         END_TEST;
     }
 
+    TEST(smatrix parallel transpose) {
+        const std::size_t rows = 3000;
+        const std::size_t cols = 2000;
+        SparseMatrixBuilder<double> builder(rows, cols);
+
+        for (std::size_t i = 0; i < rows; i++) {
+            for (std::size_t j = i % 7; j < cols; j += 1 + i % 50) {
+                builder.Add(i, j, i * 1.5 + j);
+            }
+        }
+
+        SparseMatrix mat = builder.Build();
+        SparseMatrix transposed = mat.Transpose();
+
+        assert(transposed.Rows() == cols && transposed.Cols() == rows);
+        assert(transposed.RealSize() == mat.RealSize());
+        assert(transposed.Get(10, 3) == mat.Get(3, 10));
+        ThreadPool pool4(4);
+        ThreadPool pool3(3);
+        assert(SparseMatrix(mat.Transpose(pool4)) == transposed);
+        assert(SparseMatrix(transposed.Transpose(pool3)) == mat);
+
+        END_TEST;
+    }
+
 
     TEST(smatrix scalar operations) {
         SparseMatrix mat({
@@ -248,6 +1241,208 @@ void SmatrixTest() {
         });
 
         assert(mat.PowElements(2) == expected_pow);
+        assert((mat + 2).PowElements(2) == expected_add.PowElements(2));
+
+        // Shifts stay sparse, the scalar goes to the offset.
+        const std::size_t n = 1000000;
+        SparseMatrix big(n, n);
+        big.Set(3, 5, 2);
+        SparseMatrix shifted = big + 1.0;
+        assert(shifted.RealSize() == 1);
+        assert(shifted.Get(3, 5) == 3 && shifted.Get(7, 7) == 1);
+        assert((shifted - 1.0) == big);
+        assert(SparseMatrix(shifted - big).RealSize() == 0);
+
+        shifted.Set(0, 0, 1);
+        assert(shifted.RealSize() == 1);
+        shifted = shifted * 2;
+        assert(shifted.Get(3, 5) == 6 && shifted.Get(0, 0) == 2);
+
+        std::vector<double> ones(n, 1);
+        std::vector<double> row_sums = shifted * ones;
+        assert(row_sums[3] == 2.0 * n + 4 && row_sums[4] == 2.0 * n);
+
+        // Products with offsets match the products of the explicit matrices.
+        SparseMatrix lhs = mat + 2;
+        SparseMatrix rhs = mat - 1;
+        SparseMatrix product = lhs * rhs;
+        assert(product == SparseMatrix(expected_add * expected_sub));
+        assert(SparseMatrix(lhs * mat) == SparseMatrix(expected_add * mat));
+        assert(SparseMatrix(mat * rhs) == SparseMatrix(mat * expected_sub));
+        assert(SparseMatrix(lhs.Transpose()) == SparseMatrix(expected_add.Transpose()));
+        assert(IsEqual(lhs.Determinant(), expected_add.Determinant(), SparseMatrix::EPSYLON));
+
+        std::vector<double> vec = { 1, -2, 3 };
+        assert(lhs * vec == expected_add * vec);
+
+        END_TEST;
+    }
+
+    TEST(smatrix compound operators) {
+        SparseMatrix mat = {
+            { 1, 0, -3 },
+            { 0, 5, 0 },
+            { 7, 0, 9 }
+        };
+        mat.Compress();
+        const double *values = mat.Csr().values.data();
+
+        mat *= 2;
+        mat /= 4;
+        mat.Apply([](double value) { return value * value; });
+        assert(mat.Csr().values.data() == values);
+        assert(mat.RealSize() == 5 && mat.Offset() == 0);
+
+        SparseMatrix squared = {
+            { 0.25, 0, 2.25  },
+            { 0, 6.25, 0     },
+            { 12.25, 0, 20.25 }
+        };
+        assert(mat == squared);
+
+        // Entries that become zero are dropped.
+        mat.Apply([](double value) { return value > 10 ? value : 0; });
+        assert(mat.RealSize() == 2);
+
+        // f(0) != 0 moves into the offset instead of filling the matrix.
+        SparseMatrix flat = mat;
+        flat.Uncompress();
+        flat.Apply([](double value) { return value + 1; });
+        assert(flat.RealSize() == 2 && flat.Offset() == 1);
+        assert(flat.Get(2, 0) == 13.25 && flat.Get(1, 1) == 1);
+
+        flat -= 1;
+        flat += mat;
+        flat -= mat * 3;
+        assert(flat == mat * -1);
+
+        SparseMatrix product = squared;
+        product *= squared;
+        assert(product == SparseMatrix(squared * squared));
+
+        bool thrown = false;
+        try {
+            flat /= 0;
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        END_TEST;
+    }
+
+    TEST(smatrix move-aware operators) {
+        SparseMatrix mat = {
+            { 1, 0, 2 },
+            { 0, 3, 0 },
+            { 4, 0, 5 }
+        };
+        mat.Compress();
+        const double *values = mat.Csr().values.data();
+
+        // Expiring operands keep their storage.
+        SparseMatrix scaled = std::move(mat) * 2.0;
+        assert(scaled.Csr().values.data() == values);
+
+        SparseMatrix diagonal = {
+            { 1, 0, 0 },
+            { 0, 1, 0 },
+            { 0, 0, -10 }
+        };
+        SparseMatrix sum = std::move(scaled) + diagonal;
+        assert(sum.Csr().values.data() == values);
+        assert(sum.RealSize() == 4);
+
+        SparseMatrix expected = {
+            { 3, 0, 4 },
+            { 0, 7, 0 },
+            { 8, 0, 0 }
+        };
+        assert(sum == expected);
+
+        // A new entry needs new arrays.
+        sum -= SparseMatrix({ { 0, 1, 0 }, { 0, 0, 0 }, { 0, 0, 0 } });
+        assert(sum.Get(0, 1) == -1 && sum.RealSize() == 5);
+
+        std::size_t stored = 0;
+        for (const auto& row : expected) {
+            stored += row.RealSize();
+        }
+        assert(stored == expected.RealSize());
+
+        std::ostringstream out;
+        out << expected + 1;
+        assert(out.str() == "4 1 5 \n1 8 1 \n9 1 1 \n");
+
+        END_TEST;
+    }
+
+    TEST(smatrix lazy expressions) {
+        SparseMatrix a = {
+            { 1, 0, 2 },
+            { 0, 3, 0 },
+            { 4, 0, 5 }
+        };
+        SparseMatrix b = {
+            { 0, 1, 0 },
+            { 0, 3, 0 },
+            { 6, 0, 0 }
+        };
+        SparseMatrix c = {
+            { 1, 0, 0 },
+            { 0, 0, 0 },
+            { 0, 0, 1 }
+        };
+
+        SparseMatrix fused = Lazy(a) + b - c * 2.0;
+        assert(fused == SparseMatrix(a + b - c * 2.0));
+        assert(fused.RealSize() == 6);
+
+        SparseMatrix scaled = 3.0 * Lazy(a) / 2.0 - b;
+        assert(scaled == SparseMatrix(a * 1.5 - b));
+
+        // Background values go to the offset, the result stays sparse.
+        SparseMatrix shifted = Lazy(a) + 1.0;
+        assert(shifted.RealSize() == a.RealSize() && shifted.Offset() == 1);
+        assert(shifted == a + 1);
+
+        SparseMatrix mapped = Pow(Lazy(a) - b, 2) + Map(c, [](double x) { return -x; });
+        assert(mapped == SparseMatrix(SparseMatrix(a - b).PowElements(2) - c));
+
+        // Products are evaluated eagerly and join the expression.
+        SparseMatrix product = Lazy(a) * b + c;
+        assert(product == SparseMatrix(a * b + c));
+        SparseMatrix nested = (Lazy(a) + c) * (Lazy(b) - c) - a;
+        assert(nested == SparseMatrix(SparseMatrix(a + c) * SparseMatrix(b - c) - a));
+
+        // Temporary operands are kept by the expression until it is evaluated.
+        auto with_temporary = Lazy(a) + (b + c);
+        auto mapped_temporary = Map(b - c, [](double x) { return 2 * x; }) - (a + c);
+        assert(SparseMatrix(Evaluate(with_temporary)) == SparseMatrix(a + b + c));
+        assert(SparseMatrix(Evaluate(mapped_temporary)) == SparseMatrix(SparseMatrix(b - c) * 2.0 - a - c));
+
+        // Big expressions are evaluated in parallel chunks.
+        const std::size_t n = 200000;
+        SparseMatrixBuilder<double> builder1(n, n);
+        SparseMatrixBuilder<double> builder2(n, n);
+        for (std::size_t i = 0; i < n; i++) {
+            builder1.Add(i, i, 1);
+            builder2.Add(i, (i * 7) % n, 2);
+        }
+        SparseMatrix big1 = builder1.Build();
+        SparseMatrix big2 = builder2.Build();
+
+        ThreadPool pool(4);
+        SparseMatrix sum = Evaluate(Lazy(big1) * 3.0 - big2, pool);
+        assert(sum == SparseMatrix(big1 * 3.0 - big2));
+
+        bool thrown = false;
+        try {
+            SparseMatrix wrong = Lazy(a) + SparseMatrix(2, 3);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
 
         END_TEST;
     }
@@ -264,6 +1459,30 @@ void SmatrixTest() {
         };
 
         assert(mat.Power(4) == result);
+        assert(mat.Power(5) == SparseMatrix(result * mat));
+        assert(mat.Power(1) == mat);
+        assert(mat.Power(0) == SparseMatrix(MakeIdentityMatrix<double>(2)));
+        assert(mat.Power(-4) == result.Inverse());
+
+        std::vector<double> vec = { 3, -2 };
+        assert(mat.PowerMultiply(4, vec) == result * vec);
+        assert(mat.PowerMultiply(0, vec) == vec);
+
+        // A cyclic shift returns to the identity after n steps.
+        const std::size_t n = 1000;
+        SparseMatrixBuilder<double> builder(n, n);
+        for (std::size_t i = 0; i < n; i++) {
+            builder.Add(i, (i + 1) % n, 1);
+        }
+        SparseMatrix shift = builder.Build();
+        assert(shift.Power(3 * n) == SparseMatrix(MakeIdentityMatrix<double>(n)));
+
+        std::vector<double> x(n);
+        for (std::size_t i = 0; i < n; i++) {
+            x[i] = i;
+        }
+        std::vector<double> y = shift.PowerMultiply(n + 7, x);
+        assert(y[0] == 7 && y[n - 1] == 6);
 
         END_TEST;
     }
@@ -362,6 +1581,163 @@ void VmatrixTest() {
 
         END_TEST;
     }
+
+    TEST(vmatrix blocked multiplication) {
+        VectorMatrix<double> wide = {
+            { 1, 2 },
+            { 0, 1 },
+            { 3, 0 },
+        };
+
+        VectorMatrix<double> tall = {
+            { 1, 0, 2, 0, 1 },
+            { 0, 1, 0, 3, 1 },
+        };
+
+        VectorMatrix<double> product = {
+            { 1, 2, 2, 6, 3 },
+            { 0, 1, 0, 3, 1 },
+            { 3, 0, 6, 0, 3 },
+        };
+
+        assert(wide * tall == product);
+
+        bool thrown = false;
+        try {
+            tall * tall;
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // Crosses the k and m blocks and leaves partial tiles on every edge.
+        const std::size_t m = 130, k = 300, n = 70;
+        VectorMatrix<double> a(m, k);
+        VectorMatrix<double> b(k, n);
+        VectorMatrix<long long> ai(m, k);
+        VectorMatrix<long long> bi(k, n);
+        for (std::size_t i = 0; i < m; i++) {
+            for (std::size_t j = 0; j < k; j++) {
+                a.Set(i, j, (i * 7 + j * 3) % 11);
+                ai.Set(i, j, (i * 7 + j * 3) % 11);
+            }
+        }
+        for (std::size_t i = 0; i < k; i++) {
+            for (std::size_t j = 0; j < n; j++) {
+                b.Set(i, j, (i + j * 5) % 7 - 3.0);
+                bi.Set(i, j, (i + j * 5) % 7 - 3);
+            }
+        }
+
+        VectorMatrix<double> c(m, n);
+        VectorMatrix<long long> ci(m, n);
+        for (std::size_t i = 0; i < m; i++) {
+            for (std::size_t j = 0; j < n; j++) {
+                c.Set(i, j, 1);
+                ci.Set(i, j, 1);
+            }
+        }
+
+        a.MultiplyAdd(2, b, -1, c);
+        ai.MultiplyAdd(2, bi, -1, ci);
+        VectorMatrix<double> plain = a * b;
+
+        for (std::size_t i = 0; i < m; i++) {
+            for (std::size_t j = 0; j < n; j++) {
+                long long expected = 0;
+                for (std::size_t p = 0; p < k; p++) {
+                    expected += ai.Get(i, p) * bi.Get(p, j);
+                }
+                assert(plain.Get(i, j) == expected);
+                assert(c.Get(i, j) == 2 * expected - 1);
+                assert(ci.Get(i, j) == 2 * expected - 1);
+            }
+        }
+
+        END_TEST;
+    }
+
+    TEST(vmatrix parallel multiplication) {
+        const std::size_t m = 300, k = 280, n = 170;
+        VectorMatrix<double> a(m, k);
+        VectorMatrix<double> b(k, n);
+        for (std::size_t i = 0; i < m; i++) {
+            for (std::size_t j = 0; j < k; j++) {
+                a.Set(i, j, std::sin(i * 0.37 + j * 1.1));
+            }
+        }
+        for (std::size_t i = 0; i < k; i++) {
+            for (std::size_t j = 0; j < n; j++) {
+                b.Set(i, j, std::cos(i * 0.53 - j * 0.7));
+            }
+        }
+
+        ThreadPool serial(1);
+        const VectorMatrix<double> expected = a.Multiply(b, serial);
+
+        for (std::size_t threads : { 2, 4, 9 }) {
+            ThreadPool pool(threads);
+            assert(a.Multiply(b, pool) == expected);
+        }
+
+        END_TEST;
+    }
+
+    TEST(vmatrix storage) {
+        VectorMatrix<double> mat(5, 3);
+        assert(mat.Stride() >= mat.Cols());
+        for (std::size_t i = 0; i < mat.Rows(); i++) {
+            assert(reinterpret_cast<std::uintptr_t>(mat.RowData(i)) % VMATRIX_ALIGNMENT == 0);
+        }
+
+        for (std::size_t i = 0; i < mat.Rows(); i++) {
+            for (std::size_t j = 0; j < mat.Cols(); j++) {
+                mat.Set(i, j, i * 10 + j);
+            }
+        }
+
+        auto row = mat.Row(2);
+        assert(row.size() == 3 && row[1] == 21);
+        row[1] = -1;
+        assert(mat.Get(2, 1) == -1);
+
+        auto col = mat.Col(2);
+        assert(col.size() == 5 && col[4] == 42);
+        double sum = 0;
+        for (double value : col) {
+            sum += value;
+        }
+        assert(sum == 2 + 12 + 22 + 32 + 42);
+
+        VectorMatrix<double> copy = mat;
+        copy.Set(0, 0, 7);
+        assert(copy != mat && mat.Get(0, 0) == 0);
+
+        copy = { { 1, 2 }, { 3, 4 } };
+        assert(copy.Rows() == 2 && copy.Cols() == 2 && copy.Get(1, 0) == 3);
+
+        std::ostringstream out;
+        out << copy;
+        assert(out.str() == "1 2\n3 4");
+
+        bool thrown = false;
+        try {
+            copy + mat;
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        thrown = false;
+        try {
+            mat - copy;
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        END_TEST;
+    }
 }
 
 void TestSpeed() {
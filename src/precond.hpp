@@ -0,0 +1,382 @@
+#ifndef _PRECOND_H_
+#define _PRECOND_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+#include "smatrix.hpp"
+
+constexpr char PRECOND_ZERO_DIAGONAL[] = "Preconditioner needs a nonzero diagonal";
+constexpr char PRECOND_ZERO_PIVOT   [] = "Incomplete factorization hit a zero pivot";
+constexpr char PRECOND_INVALID_SIZE [] = "Vector has invalid size for the preconditioner";
+
+// A level of a triangular solve with less work than this runs on the
+// calling thread.
+constexpr std::size_t PARALLEL_MIN_LEVEL_WORK = 1 << 12;
+
+// Diagonal scaling, z = D^-1 * r.
+class JacobiPreconditioner {
+public:
+    using value_type = double;
+    using index_type = std::size_t;
+
+    explicit JacobiPreconditioner(const SparseMatrix& matrix) {
+        if (!matrix.IsSquare()) {
+            throw std::invalid_argument(MATRIX_MUST_BE_SQUARE);
+        }
+
+        inverse_diagonal_.resize(matrix.Rows());
+        for (index_type row = 0; row < matrix.Rows(); row++) {
+            const value_type diagonal = matrix.Get(row, row);
+            if (diagonal == 0) {
+                throw std::invalid_argument(PRECOND_ZERO_DIAGONAL);
+            }
+
+            inverse_diagonal_[row] = 1 / diagonal;
+        }
+    }
+
+    void Apply(const std::vector<value_type>& r, std::vector<value_type>& z) const {
+        if (r.size() != inverse_diagonal_.size()) {
+            throw std::invalid_argument(PRECOND_INVALID_SIZE);
+        }
+
+        z.resize(r.size());
+        for (index_type i = 0; i < r.size(); i++) {
+            z[i] = inverse_diagonal_[i] * r[i];
+        }
+    }
+
+private:
+    std::vector<value_type> inverse_diagonal_;
+};
+
+// Incomplete LU factorization A ~ L * U without pivoting, stored like the
+// factors of SparseLU: L is unit lower triangular without its diagonal and
+// every row of U starts with the diagonal.
+//
+// ILU(0) keeps exactly the pattern of A. ILUT allows fill-in but drops
+// every entry smaller than drop_tolerance times the norm of its row of A.
+//
+// Apply solves L * U * z = r. Rows of a triangular factor are grouped into
+// levels that only depend on earlier levels; the rows of a large level
+// are solved in parallel on the pool.
+class IncompleteLU {
+public:
+    using value_type = double;
+    using index_type = std::size_t;
+    using size_type  = std::size_t;
+    using csr_type   = SparseMatrix::CsrStorage;
+
+    // ILU(0).
+    explicit IncompleteLU(const SparseMatrix& matrix, ThreadPool& pool = DefaultThreadPool())
+        : pool_(&pool) {
+        if (!matrix.IsSquare()) {
+            throw std::invalid_argument(MATRIX_MUST_BE_SQUARE);
+        }
+
+        if (matrix.Offset() != 0) {
+            *this = IncompleteLU(Expanded(matrix), pool);
+            return;
+        }
+
+        n_ = matrix.Rows();
+
+        csr_type lu;
+        lu.row_ptr.push_back(0);
+        for (index_type row = 0; row < n_; row++) {
+            const auto entries = matrix.NonZeros(row);
+            lu.col_idx.insert(lu.col_idx.end(), entries.Indices(), entries.Indices() + entries.RealSize());
+            lu.values.insert(lu.values.end(), entries.Values(), entries.Values() + entries.RealSize());
+            lu.row_ptr.push_back(lu.values.size());
+        }
+
+        const size_type none = lu.values.size();
+        std::vector<size_type> position(n_, none);
+        std::vector<size_type> diagonal(n_);
+
+        for (index_type i = 0; i < n_; i++) {
+            const size_type begin = lu.row_ptr[i];
+            const size_type end = lu.row_ptr[i + 1];
+            for (size_type pos = begin; pos < end; pos++) {
+                position[lu.col_idx[pos]] = pos;
+            }
+
+            size_type pos = begin;
+            for (; pos < end && lu.col_idx[pos] < i; pos++) {
+                const index_type k = lu.col_idx[pos];
+                const value_type l = lu.values[pos] /= lu.values[diagonal[k]];
+
+                // Only entries already in row i are updated.
+                for (size_type upper = diagonal[k] + 1; upper < lu.row_ptr[k + 1]; upper++) {
+                    const size_type target = position[lu.col_idx[upper]];
+                    if (target != none)
+                        lu.values[target] -= l * lu.values[upper];
+                }
+            }
+
+            if (pos == end || lu.col_idx[pos] != i || lu.values[pos] == 0) {
+                throw std::invalid_argument(PRECOND_ZERO_PIVOT);
+            }
+
+            diagonal[i] = pos;
+            for (size_type entry = begin; entry < end; entry++) {
+                position[lu.col_idx[entry]] = none;
+            }
+        }
+
+        lower_.row_ptr.push_back(0);
+        upper_.row_ptr.push_back(0);
+        for (index_type i = 0; i < n_; i++) {
+            const auto cols = lu.col_idx.begin();
+            const auto values = lu.values.begin();
+
+            lower_.col_idx.insert(lower_.col_idx.end(), cols + lu.row_ptr[i], cols + diagonal[i]);
+            lower_.values.insert(lower_.values.end(), values + lu.row_ptr[i], values + diagonal[i]);
+            lower_.row_ptr.push_back(lower_.values.size());
+
+            upper_.col_idx.insert(upper_.col_idx.end(), cols + diagonal[i], cols + lu.row_ptr[i + 1]);
+            upper_.values.insert(upper_.values.end(), values + diagonal[i], values + lu.row_ptr[i + 1]);
+            upper_.row_ptr.push_back(upper_.values.size());
+        }
+
+        BuildSchedules();
+    }
+
+    // ILUT with the given drop tolerance.
+    IncompleteLU(const SparseMatrix& matrix, double drop_tolerance,
+                 ThreadPool& pool = DefaultThreadPool())
+        : pool_(&pool) {
+        if (!matrix.IsSquare()) {
+            throw std::invalid_argument(MATRIX_MUST_BE_SQUARE);
+        }
+
+        if (matrix.Offset() != 0) {
+            *this = IncompleteLU(Expanded(matrix), drop_tolerance, pool);
+            return;
+        }
+
+        n_ = matrix.Rows();
+        lower_.row_ptr.push_back(0);
+        upper_.row_ptr.push_back(0);
+
+        // Row i of the factors is formed in a dense work row; cols lists
+        // its nonzero positions and the heap the ones left of the diagonal
+        // still to eliminate, in increasing order.
+        std::vector<value_type> work(n_);
+        std::vector<bool> used(n_);
+        std::vector<index_type> cols;
+        std::priority_queue<index_type, std::vector<index_type>, std::greater<index_type>> pending;
+
+        for (index_type i = 0; i < n_; i++) {
+            value_type norm = 0;
+            for (const auto [col, value] : matrix.NonZeros(i)) {
+                work[col] = value;
+                used[col] = true;
+                cols.push_back(col);
+                if (col < i)
+                    pending.push(col);
+
+                norm += value * value;
+            }
+
+            const value_type drop = drop_tolerance * std::sqrt(norm);
+
+            while (!pending.empty()) {
+                const index_type k = pending.top();
+                pending.pop();
+
+                const size_type diag = upper_.row_ptr[k];
+                const value_type l = work[k] /= upper_.values[diag];
+                if (std::abs(l) < drop) {
+                    work[k] = 0;
+                    continue;
+                }
+
+                for (size_type pos = diag + 1; pos < upper_.row_ptr[k + 1]; pos++) {
+                    const index_type col = upper_.col_idx[pos];
+                    if (!used[col]) {
+                        used[col] = true;
+                        cols.push_back(col);
+                        if (col < i)
+                            pending.push(col);
+                    }
+
+                    work[col] -= l * upper_.values[pos];
+                }
+            }
+
+            if (!used[i] || work[i] == 0) {
+                throw std::invalid_argument(PRECOND_ZERO_PIVOT);
+            }
+
+            std::sort(cols.begin(), cols.end());
+
+            upper_.col_idx.push_back(i);
+            upper_.values.push_back(work[i]);
+            for (index_type col : cols) {
+                if (col == i || std::abs(work[col]) < drop || work[col] == 0)
+                    continue;
+
+                csr_type& factor = col < i ? lower_ : upper_;
+                factor.col_idx.push_back(col);
+                factor.values.push_back(work[col]);
+            }
+
+            lower_.row_ptr.push_back(lower_.values.size());
+            upper_.row_ptr.push_back(upper_.values.size());
+
+            for (index_type col : cols) {
+                work[col] = 0;
+                used[col] = false;
+            }
+            cols.clear();
+        }
+
+        BuildSchedules();
+    }
+
+    // Solves L * U * z = r, z must not be r.
+    void Apply(const std::vector<value_type>& r, std::vector<value_type>& z) const {
+        if (r.size() != n_) {
+            throw std::invalid_argument(PRECOND_INVALID_SIZE);
+        }
+
+        z.resize(n_);
+
+        Sweep(lower_levels_, [&](index_type i) {
+            value_type sum = r[i];
+            for (size_type pos = lower_.row_ptr[i]; pos < lower_.row_ptr[i + 1]; pos++) {
+                sum -= lower_.values[pos] * z[lower_.col_idx[pos]];
+            }
+            z[i] = sum;
+        });
+
+        Sweep(upper_levels_, [&](index_type i) {
+            value_type sum = z[i];
+            const size_type diag = upper_.row_ptr[i];
+            for (size_type pos = diag + 1; pos < upper_.row_ptr[i + 1]; pos++) {
+                sum -= upper_.values[pos] * z[upper_.col_idx[pos]];
+            }
+            z[i] = sum / upper_.values[diag];
+        });
+    }
+
+    SparseMatrix L() const {
+        return SparseMatrixBase<value_type>(n_, n_, lower_);
+    }
+
+    SparseMatrix U() const {
+        return SparseMatrixBase<value_type>(n_, n_, upper_);
+    }
+
+    size_type LowerLevels() const {
+        return lower_levels_.level_ptr.size() - 1;
+    }
+
+    size_type UpperLevels() const {
+        return upper_levels_.level_ptr.size() - 1;
+    }
+
+private:
+    // The factorizations read stored entries only.
+    static SparseMatrix Expanded(const SparseMatrix& matrix) {
+        SparseMatrix expanded = matrix;
+        expanded.ExpandOffset();
+        return expanded;
+    }
+
+    // Rows of a triangular factor bucketed by level, level l being
+    // rows[level_ptr[l] .. level_ptr[l + 1]).
+    struct Schedule {
+        std::vector<size_type> level_ptr;
+        std::vector<index_type> rows;
+        std::vector<bool> parallel;
+    };
+
+    void BuildSchedules() {
+        lower_levels_ = MakeSchedule(lower_, false);
+        upper_levels_ = MakeSchedule(upper_, true);
+    }
+
+    // A row is one level above the deepest row it reads.
+    Schedule MakeSchedule(const csr_type& factor, bool upper) const {
+        std::vector<size_type> level(n_);
+        size_type levels = 0;
+
+        for (index_type step = 0; step < n_; step++) {
+            const index_type i = upper ? n_ - 1 - step : step;
+            size_type depth = 0;
+            for (size_type pos = factor.row_ptr[i] + upper; pos < factor.row_ptr[i + 1]; pos++) {
+                depth = std::max(depth, level[factor.col_idx[pos]] + 1);
+            }
+
+            level[i] = depth;
+            levels = std::max(levels, depth + 1);
+        }
+
+        Schedule schedule;
+        schedule.level_ptr.assign(levels + 1, 0);
+        for (index_type i = 0; i < n_; i++) {
+            schedule.level_ptr[level[i] + 1]++;
+        }
+        for (size_type l = 0; l < levels; l++) {
+            schedule.level_ptr[l + 1] += schedule.level_ptr[l];
+        }
+
+        schedule.rows.resize(n_);
+        std::vector<size_type> next(schedule.level_ptr.begin(), schedule.level_ptr.end() - 1);
+        for (index_type i = 0; i < n_; i++) {
+            schedule.rows[next[level[i]]++] = i;
+        }
+
+        schedule.parallel.resize(levels);
+        for (size_type l = 0; l < levels; l++) {
+            size_type work = 0;
+            for (size_type k = schedule.level_ptr[l]; k < schedule.level_ptr[l + 1]; k++) {
+                const index_type i = schedule.rows[k];
+                work += factor.row_ptr[i + 1] - factor.row_ptr[i] + 1;
+            }
+
+            schedule.parallel[l] = work >= PARALLEL_MIN_LEVEL_WORK;
+        }
+
+        return schedule;
+    }
+
+    template<typename F>
+    void Sweep(const Schedule& schedule, F solve_row) const {
+        for (size_type l = 0; l + 1 < schedule.level_ptr.size(); l++) {
+            const size_type begin = schedule.level_ptr[l];
+            const size_type count = schedule.level_ptr[l + 1] - begin;
+
+            if (!schedule.parallel[l]) {
+                for (size_type k = begin; k < begin + count; k++) {
+                    solve_row(schedule.rows[k]);
+                }
+                continue;
+            }
+
+            const size_type chunks = pool_->Threads();
+            pool_->Run(chunks, [&](size_type chunk) {
+                for (size_type k = begin + count * chunk / chunks; k < begin + count * (chunk + 1) / chunks; k++) {
+                    solve_row(schedule.rows[k]);
+                }
+            });
+        }
+    }
+
+    ThreadPool* pool_;
+    size_type n_ = 0;
+    csr_type lower_;
+    csr_type upper_;
+    Schedule lower_levels_;
+    Schedule upper_levels_;
+};
+
+#endif
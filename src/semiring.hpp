@@ -0,0 +1,95 @@
+#ifndef _SEMIRING_H_
+#define _SEMIRING_H_
+
+#include <algorithm>
+#include <limits>
+
+// Semirings for the products of SparseMatrixBase, picked at compile time:
+// a.Multiply<MinPlus<double>>(b) is Gustavson's algorithm with min for the
+// sum and + for the product, every call is inlined.
+//
+// A semiring is a type with static Zero(), Add(a, b) and Multiply(a, b).
+// Zero() is the identity of Add and the value of a cell where nothing was
+// added, so it is the value the products give to cells that are not
+// stored. Matrix products are SemiringMatrix objects (smatrix.hpp), which
+// keep Zero() as the value of missing cells and never store it.
+
+// The usual arithmetic.
+template<typename T>
+struct PlusTimes {
+    using value_type = T;
+
+    static T Zero() {
+        return T();
+    }
+
+    static T Add(const T& lhs, const T& rhs) {
+        return lhs + rhs;
+    }
+
+    static T Multiply(const T& lhs, const T& rhs) {
+        return lhs * rhs;
+    }
+};
+
+// Tropical semiring of shortest paths: a stored entry is the length of an
+// edge, the product of two adjacency matrices gives the shortest two step
+// paths. Cells without a path come out as infinity and are not stored.
+// A zero length path is a stored 0; zero length edges can be given to a
+// SemiringMatrix built from CSR arrays.
+template<typename T>
+struct MinPlus {
+    using value_type = T;
+
+    static T Zero() {
+        return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity()
+                                                    : std::numeric_limits<T>::max();
+    }
+
+    static T Add(const T& lhs, const T& rhs) {
+        return std::min(lhs, rhs);
+    }
+
+    static T Multiply(const T& lhs, const T& rhs) {
+        return lhs + rhs;
+    }
+};
+
+// Most probable paths for entries in [0, 1], or widest products of
+// nonnegative weights.
+template<typename T>
+struct MaxTimes {
+    using value_type = T;
+
+    static T Zero() {
+        return T();
+    }
+
+    static T Add(const T& lhs, const T& rhs) {
+        return std::max(lhs, rhs);
+    }
+
+    static T Multiply(const T& lhs, const T& rhs) {
+        return lhs * rhs;
+    }
+};
+
+// Reachability: any nonzero value is true and results are 0 or 1.
+template<typename T>
+struct OrAnd {
+    using value_type = T;
+
+    static T Zero() {
+        return T();
+    }
+
+    static T Add(const T& lhs, const T& rhs) {
+        return (lhs != T() || rhs != T()) ? T(1) : T();
+    }
+
+    static T Multiply(const T& lhs, const T& rhs) {
+        return (lhs != T() && rhs != T()) ? T(1) : T();
+    }
+};
+
+#endif
@@ -0,0 +1,519 @@
+#ifndef _SLU_H_
+#define _SLU_H_
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "smatrix.hpp"
+
+constexpr char LU_SINGULAR       [] = "Matrix is singular";
+constexpr char LU_PATTERN_DIFFERS[] = "Matrix has another sparsity pattern than the factorized one";
+constexpr char LU_INVALID_RHS    [] = "Right hand side has invalid size";
+constexpr char LU_INVALID_INDEX  [] = "Index of the inverse out of bounds";
+constexpr char LU_INVALID_THRESHOLD[] = "Pivot threshold must be in (0, 1]";
+
+// Sparse LU factorization with row pivoting: P * A = L * U, where L is unit
+// lower triangular (its diagonal is not stored) and U is upper triangular
+// with the diagonal first in every row. Both are kept in CSR form.
+//
+// Elimination is right-looking and row-wise. At step k the pivot is picked
+// among the remaining rows with an entry in column k: every candidate whose
+// magnitude is at least pivot_threshold times the largest one qualifies and
+// the shortest of them wins. A threshold of 1 is classic partial pivoting,
+// smaller ones trade some stability for less fill-in.
+//
+// Entries that cancel out during elimination are kept, so L and U hold the
+// full symbolic pattern and Refactor can redo the numbers alone.
+//
+// Rounding leaves tiny pivots where exact elimination would give zeros. A
+// candidate counts as zero when it is within n * DBL_EPSILON of the scale
+// of its own row, the largest magnitude the row had in A or during the
+// elimination; a column without any other candidate makes A singular.
+class SparseLU {
+public:
+    using value_type = double;
+    using index_type = std::size_t;
+    using size_type  = std::size_t;
+    using csr_type   = SparseMatrix::CsrStorage;
+
+    explicit SparseLU(const SparseMatrix& matrix, double pivot_threshold = 1.0)
+        : threshold_(pivot_threshold) {
+        // The largest candidate must always qualify.
+        if (!(threshold_ > 0 && threshold_ <= 1)) {
+            throw std::invalid_argument(LU_INVALID_THRESHOLD);
+        }
+
+        Factor(matrix);
+    }
+
+    void Factor(const SparseMatrix& matrix) {
+        if (!matrix.IsSquare()) {
+            throw std::invalid_argument(MATRIX_MUST_BE_SQUARE);
+        }
+
+        // Factors work on stored entries, a shifted matrix is dense anyway.
+        if (matrix.Offset() != 0) {
+            SparseMatrix expanded = matrix;
+            expanded.ExpandOffset();
+            Factor(expanded);
+            return;
+        }
+
+        n_ = matrix.Rows();
+        SavePattern(matrix);
+        const value_type tolerance = PivotTolerance();
+        std::vector<value_type> row_scales = RowScales(matrix);
+
+        // Remaining part of every row, sorted by column. Once column k is
+        // eliminated no unpivoted row has entries left of k + 1.
+        std::vector<std::vector<index_type>> row_cols(n_);
+        std::vector<std::vector<value_type>> row_values(n_);
+        // Rows that have (or had) an entry in a column.
+        std::vector<std::vector<index_type>> col_rows(n_);
+
+        for (const auto [row, col, value] : matrix.NonZeros()) {
+            row_cols[row].push_back(col);
+            row_values[row].push_back(value);
+            col_rows[col].push_back(row);
+        }
+
+        // Multipliers of every original row, by elimination step.
+        std::vector<std::vector<index_type>> l_cols(n_);
+        std::vector<std::vector<value_type>> l_values(n_);
+
+        std::vector<bool> pivoted(n_);
+        perm_.assign(n_, 0);
+        singular_ = false;
+
+        upper_ = csr_type();
+        upper_.row_ptr.push_back(0);
+
+        std::vector<index_type> merged_cols;
+        std::vector<value_type> merged_values;
+
+        for (index_type k = 0; k < n_; k++) {
+            std::vector<index_type>& candidates = col_rows[k];
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                [&](index_type row) { return pivoted[row]; }), candidates.end());
+
+            value_type max_abs = 0;
+            bool negligible = true;
+            for (index_type row : candidates) {
+                const value_type candidate = std::abs(row_values[row].front());
+                max_abs = std::max(max_abs, candidate);
+                if (candidate > tolerance * row_scales[row])
+                    negligible = false;
+            }
+
+            index_type pivot_row = n_;
+            for (index_type row : candidates) {
+                if (std::abs(row_values[row].front()) < threshold_ * max_abs)
+                    continue;
+
+                if (pivot_row == n_ || row_cols[row].size() < row_cols[pivot_row].size())
+                    pivot_row = row;
+            }
+
+            if (negligible) {
+                singular_ = true;
+            }
+
+            // No candidate at all: any remaining row gets a zero diagonal.
+            if (pivot_row == n_) {
+                pivot_row = std::find(pivoted.begin(), pivoted.end(), false) - pivoted.begin();
+                row_cols[pivot_row].insert(row_cols[pivot_row].begin(), k);
+                row_values[pivot_row].insert(row_values[pivot_row].begin(), 0);
+            }
+
+            pivoted[pivot_row] = true;
+            perm_[k] = pivot_row;
+
+            const std::vector<index_type>& pivot_cols = row_cols[pivot_row];
+            const std::vector<value_type>& pivot_values = row_values[pivot_row];
+            const value_type pivot = pivot_values.front();
+
+            for (index_type row : candidates) {
+                if (row == pivot_row)
+                    continue;
+
+                const value_type l = pivot == 0 ? 0 : row_values[row].front() / pivot;
+                l_cols[row].push_back(k);
+                l_values[row].push_back(l);
+
+                // row -= l * pivot row, both without their column k entry.
+                merged_cols.clear();
+                merged_values.clear();
+
+                const std::vector<index_type>& cols = row_cols[row];
+                const std::vector<value_type>& values = row_values[row];
+                value_type& scale = row_scales[row];
+                size_type i = 1;
+                size_type j = 1;
+                while (i < cols.size() || j < pivot_cols.size()) {
+                    if (j == pivot_cols.size() || (i < cols.size() && cols[i] < pivot_cols[j])) {
+                        merged_cols.push_back(cols[i]);
+                        merged_values.push_back(values[i++]);
+                    } else if (i == cols.size() || pivot_cols[j] < cols[i]) {
+                        col_rows[pivot_cols[j]].push_back(row);
+                        merged_cols.push_back(pivot_cols[j]);
+                        merged_values.push_back(-l * pivot_values[j++]);
+                    } else {
+                        merged_cols.push_back(cols[i]);
+                        merged_values.push_back(values[i++] - l * pivot_values[j++]);
+                    }
+                    scale = std::max(scale, std::abs(merged_values.back()));
+                }
+
+                row_cols[row].swap(merged_cols);
+                row_values[row].swap(merged_values);
+            }
+
+            upper_.col_idx.insert(upper_.col_idx.end(), pivot_cols.begin(), pivot_cols.end());
+            upper_.values.insert(upper_.values.end(), pivot_values.begin(), pivot_values.end());
+            upper_.row_ptr.push_back(upper_.values.size());
+
+            std::vector<index_type>().swap(row_cols[pivot_row]);
+            std::vector<value_type>().swap(row_values[pivot_row]);
+            std::vector<index_type>().swap(candidates);
+        }
+
+        lower_ = csr_type();
+        lower_.row_ptr.push_back(0);
+        for (index_type k = 0; k < n_; k++) {
+            const index_type row = perm_[k];
+            lower_.col_idx.insert(lower_.col_idx.end(), l_cols[row].begin(), l_cols[row].end());
+            lower_.values.insert(lower_.values.end(), l_values[row].begin(), l_values[row].end());
+            lower_.row_ptr.push_back(lower_.values.size());
+        }
+    }
+
+    // Recomputes L and U for a matrix with the same sparsity pattern but
+    // other values, keeping the pivot order and the patterns of the factors.
+    // Falls back to a full Factor if a kept pivot turns out to be too small.
+    void Refactor(const SparseMatrix& matrix) {
+        if (!matrix.IsSquare() || matrix.Rows() != n_) {
+            throw std::invalid_argument(MATRIX_SIZE_DIFFER);
+        }
+
+        if (matrix.Offset() != 0) {
+            SparseMatrix expanded = matrix;
+            expanded.ExpandOffset();
+            Refactor(expanded);
+            return;
+        }
+
+        if (!SamePattern(matrix)) {
+            throw std::invalid_argument(LU_PATTERN_DIFFERS);
+        }
+
+        // Row by row: row k of P * A minus the multiples of the previous
+        // rows of U given by the pattern of row k of L.
+        std::vector<value_type> work(n_);
+        const value_type tolerance = PivotTolerance();
+        const std::vector<value_type> row_scales = RowScales(matrix);
+        singular_ = false;
+
+        for (index_type k = 0; k < n_; k++) {
+            for (size_type pos = lower_.row_ptr[k]; pos < lower_.row_ptr[k + 1]; pos++) {
+                work[lower_.col_idx[pos]] = 0;
+            }
+
+            for (size_type pos = upper_.row_ptr[k]; pos < upper_.row_ptr[k + 1]; pos++) {
+                work[upper_.col_idx[pos]] = 0;
+            }
+
+            for (const auto [col, value] : matrix.NonZeros(perm_[k])) {
+                work[col] = value;
+            }
+
+            for (size_type pos = lower_.row_ptr[k]; pos < lower_.row_ptr[k + 1]; pos++) {
+                const index_type step = lower_.col_idx[pos];
+                const value_type l = work[step] / upper_.values[upper_.row_ptr[step]];
+                lower_.values[pos] = l;
+
+                for (size_type u = upper_.row_ptr[step] + 1; u < upper_.row_ptr[step + 1]; u++) {
+                    work[upper_.col_idx[u]] -= l * upper_.values[u];
+                }
+            }
+
+            value_type scale = row_scales[perm_[k]];
+            for (size_type pos = upper_.row_ptr[k]; pos < upper_.row_ptr[k + 1]; pos++) {
+                upper_.values[pos] = work[upper_.col_idx[pos]];
+                scale = std::max(scale, std::abs(upper_.values[pos]));
+            }
+
+            if (std::abs(upper_.values[upper_.row_ptr[k]]) <= tolerance * scale) {
+                Factor(matrix);
+                return;
+            }
+        }
+    }
+
+    bool IsSingular() const {
+        return singular_;
+    }
+
+    // Product of the diagonal of U with the sign of the permutation.
+    value_type Determinant() const {
+        if (singular_)
+            return 0;
+
+        value_type result = PermutationSign();
+        for (index_type k = 0; k < n_; k++) {
+            result *= upper_.values[upper_.row_ptr[k]];
+        }
+
+        return result;
+    }
+
+    std::vector<value_type> Solve(const std::vector<value_type>& rhs) const {
+        std::vector<value_type> x = rhs;
+        SolveInPlace(x);
+        return x;
+    }
+
+    // Overwrites the right hand side with the solution, O(nnz(L + U)).
+    void SolveInPlace(std::vector<value_type>& x) const {
+        std::vector<value_type> work(n_);
+        SolveInPlace(x, work);
+        x.swap(work);
+    }
+
+    // Solves A * X = B for every column of B, columns are spread over the
+    // threads of the pool. The offset of B is part of every column.
+    SparseMatrix Solve(const SparseMatrix& rhs, ThreadPool& pool = DefaultThreadPool()) const {
+        if (rhs.Rows() != n_) {
+            throw std::invalid_argument(LU_INVALID_RHS);
+        }
+
+        const SparseMatrix columns = rhs.Transpose();
+        const value_type offset = rhs.Offset();
+        return SolveColumns(rhs.Cols(), pool, [&](index_type col, std::vector<value_type>& x) {
+            std::fill(x.begin(), x.end(), offset);
+            for (const auto [row, value] : columns.NonZeros(col)) {
+                x[row] = value + offset;
+            }
+        });
+    }
+
+    SparseMatrix Inverse(ThreadPool& pool = DefaultThreadPool()) const {
+        std::vector<index_type> cols(n_);
+        for (index_type col = 0; col < n_; col++) {
+            cols[col] = col;
+        }
+
+        return InverseColumns(cols, pool);
+    }
+
+    // The given columns of the inverse, column j of the result is column
+    // cols[j] of the inverse.
+    SparseMatrix InverseColumns(const std::vector<index_type>& cols,
+                                ThreadPool& pool = DefaultThreadPool()) const {
+        for (index_type col : cols) {
+            if (col >= n_)
+                throw std::invalid_argument(LU_INVALID_INDEX);
+        }
+
+        return SolveColumns(cols.size(), pool, [&](index_type j, std::vector<value_type>& x) {
+            x[cols[j]] = 1;
+        });
+    }
+
+    // A single entry of the inverse at the cost of one solve.
+    value_type InverseEntry(index_type row, index_type col) const {
+        if (row >= n_ || col >= n_) {
+            throw std::invalid_argument(LU_INVALID_INDEX);
+        }
+
+        std::vector<value_type> x(n_);
+        x[col] = 1;
+        SolveInPlace(x);
+
+        return x[row];
+    }
+
+    SparseMatrix L() const {
+        return SparseMatrixBase<value_type>(n_, n_, lower_);
+    }
+
+    SparseMatrix U() const {
+        return SparseMatrixBase<value_type>(n_, n_, upper_);
+    }
+
+    // Row k of P * A is row Permutation()[k] of A.
+    const std::vector<index_type>& Permutation() const {
+        return perm_;
+    }
+
+    size_type Rows() const {
+        return n_;
+    }
+
+    // Number of stored entries of L and U together.
+    size_type RealSize() const {
+        return lower_.values.size() + upper_.values.size();
+    }
+
+private:
+    // Writes the solution for the right hand side x into result, x is
+    // clobbered. The forward substitution starts at the first nonzero of
+    // P * x, which makes unit vectors cheaper.
+    void SolveInPlace(std::vector<value_type>& x, std::vector<value_type>& result) const {
+        if (singular_) {
+            throw std::invalid_argument(LU_SINGULAR);
+        }
+
+        if (x.size() != n_) {
+            throw std::invalid_argument(LU_INVALID_RHS);
+        }
+
+        std::vector<value_type>& y = result;
+        y.resize(n_);
+
+        index_type first = n_;
+        for (index_type k = 0; k < n_; k++) {
+            y[k] = x[perm_[k]];
+            if (first == n_ && y[k] != 0)
+                first = k;
+        }
+
+        for (index_type k = first; k < n_; k++) {
+            value_type sum = y[k];
+            for (size_type pos = lower_.row_ptr[k]; pos < lower_.row_ptr[k + 1]; pos++) {
+                sum -= lower_.values[pos] * y[lower_.col_idx[pos]];
+            }
+            y[k] = sum;
+        }
+
+        for (index_type k = n_; k-- > 0;) {
+            value_type sum = y[k];
+            const size_type diag = upper_.row_ptr[k];
+            for (size_type pos = diag + 1; pos < upper_.row_ptr[k + 1]; pos++) {
+                sum -= upper_.values[pos] * y[upper_.col_idx[pos]];
+            }
+            y[k] = sum / upper_.values[diag];
+        }
+    }
+
+    // Solves for count right hand sides, fill(j, x) writes the j-th one
+    // into a zeroed x. Every chunk of columns collects its own triplets,
+    // they are put together once all are done.
+    template<typename Fill>
+    SparseMatrix SolveColumns(size_type count, ThreadPool& pool, Fill fill) const {
+        if (singular_) {
+            throw std::invalid_argument(LU_SINGULAR);
+        }
+
+        const size_type chunks = std::max<size_type>(1, std::min(count, pool.Threads() * 4));
+        std::vector<SparseMatrixBuilder<value_type>> parts(chunks, SparseMatrixBuilder<value_type>(n_, count));
+
+        pool.Run(chunks, [&](size_type chunk) {
+            std::vector<value_type> x(n_);
+            std::vector<value_type> solution(n_);
+
+            for (index_type j = count * chunk / chunks; j < count * (chunk + 1) / chunks; j++) {
+                std::fill(x.begin(), x.end(), 0);
+                fill(j, x);
+                SolveInPlace(x, solution);
+
+                for (index_type row = 0; row < n_; row++) {
+                    if (solution[row] != 0)
+                        parts[chunk].Add(row, j, solution[row]);
+                }
+            }
+        });
+
+        for (size_type chunk = 1; chunk < chunks; chunk++) {
+            parts[0].Append(std::move(parts[chunk]));
+        }
+
+        return parts[0].Build();
+    }
+
+    value_type PermutationSign() const {
+        std::vector<bool> visited(n_);
+        value_type sign = 1;
+
+        for (index_type start = 0; start < n_; start++) {
+            if (visited[start])
+                continue;
+
+            size_type length = 0;
+            for (index_type k = start; !visited[k]; k = perm_[k]) {
+                visited[k] = true;
+                length++;
+            }
+
+            if (length % 2 == 0)
+                sign = -sign;
+        }
+
+        return sign;
+    }
+
+    // A pivot at or below this times the scale of its row is taken as zero.
+    value_type PivotTolerance() const {
+        return n_ * std::numeric_limits<value_type>::epsilon();
+    }
+
+    // Largest magnitude of every row of A.
+    static std::vector<value_type> RowScales(const SparseMatrix& matrix) {
+        std::vector<value_type> result(matrix.Rows());
+        for (const auto [row, col, value] : matrix.NonZeros()) {
+            result[row] = std::max(result[row], std::abs(value));
+        }
+
+        return result;
+    }
+
+    void SavePattern(const SparseMatrix& matrix) {
+        pattern_row_ptr_.assign(1, 0);
+        pattern_col_idx_.clear();
+        pattern_col_idx_.reserve(matrix.RealSize());
+
+        for (index_type row = 0; row < n_; row++) {
+            for (const auto [col, value] : matrix.NonZeros(row)) {
+                pattern_col_idx_.push_back(col);
+            }
+            pattern_row_ptr_.push_back(pattern_col_idx_.size());
+        }
+    }
+
+    bool SamePattern(const SparseMatrix& matrix) const {
+        for (index_type row = 0; row < n_; row++) {
+            const auto view = matrix.NonZeros(row);
+            const size_type first = pattern_row_ptr_[row];
+
+            if (view.RealSize() != pattern_row_ptr_[row + 1] - first)
+                return false;
+
+            if (!std::equal(view.Indices(), view.Indices() + view.RealSize(),
+                            pattern_col_idx_.begin() + first))
+                return false;
+        }
+
+        return true;
+    }
+
+    double threshold_;
+    size_type n_ = 0;
+    bool singular_ = false;
+    std::vector<index_type> perm_;
+    csr_type lower_;
+    csr_type upper_;
+    std::vector<size_type> pattern_row_ptr_;
+    std::vector<index_type> pattern_col_idx_;
+};
+
+inline SparseMatrix::value_type SparseMatrix::Determinant() const {
+    return SparseLU(*this).Determinant();
+}
+
+inline SparseMatrix SparseMatrix::Inverse() const {
+    return SparseLU(*this).Inverse();
+}
+
+#endif
@@ -1,21 +1,161 @@
 #ifndef _SMATRIX_H_
 #define _SMATRIX_H_
 
+#include <algorithm>
 #include <cstddef>
+#include <functional>
 #include <initializer_list>
 #include <iterator>
 #include <ostream>
 #include <pthread.h>
 #include <stdexcept>
 #include <map>
+#include <memory>
 #include <iostream>
 #include <type_traits>
 #include <cmath>
+#include <utility>
+#include <vector>
+
+#include "semiring.hpp"
+#include "thread_pool.hpp"
+#include "vmatrix.hpp"
 
 constexpr char INDEX_OOB[] = "Index out of bounds.";
 constexpr char ITER_OOB [] = "Dereferencing an out of bounds iterator.";
 constexpr char ROW_OOB  [] = "Row out of bounds.";
 constexpr char COL_OOB  [] = "Col out of bounds.";
+constexpr char VECTOR_SIZE_DIFFER[] = "Vectors are of different sizes";
+
+// A stored entry of a sparse vector or of a matrix row.
+template <typename T>
+struct SparseEntry {
+    std::size_t index;
+    const T& value;
+};
+
+// Visits entries kept in parallel index and value arrays.
+template <typename T>
+class ArrayEntryIter {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type        = SparseEntry<T>;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = void;
+    using reference         = value_type;
+
+    ArrayEntryIter(const std::size_t *index, const T *value)
+        : index_(index)
+        , value_(value) {}
+
+    ArrayEntryIter& operator++() {
+        index_++;
+        value_++;
+        return *this;
+    }
+
+    ArrayEntryIter operator++(int) {
+        auto old = *this;
+        ++(*this);
+        return old;
+    }
+
+    bool operator==(const ArrayEntryIter& other) const {
+        return index_ == other.index_;
+    }
+
+    bool operator!=(const ArrayEntryIter& other) const {
+        return index_ != other.index_;
+    }
+
+    value_type operator*() const {
+        return { *index_, *value_ };
+    }
+
+private:
+    const std::size_t *index_;
+    const T *value_;
+};
+
+template <typename It>
+class IterRange {
+public:
+    IterRange(It begin, It end)
+        : begin_(begin)
+        , end_(end) {}
+
+    It begin() const {
+        return begin_;
+    }
+
+    It end() const {
+        return end_;
+    }
+
+private:
+    It begin_;
+    It end_;
+};
+
+// Merges two index-sorted entry arrays in a single pass. For every index
+// present in either of them op(lhs, rhs) is appended to the output, with
+// zero standing in for a missing entry. Zero results are dropped.
+template <typename T, typename Op>
+void MergeSortedEntries(const std::size_t *lhs_indices, const T *lhs_values, std::size_t lhs_nnz,
+                        const std::size_t *rhs_indices, const T *rhs_values, std::size_t rhs_nnz,
+                        Op op, std::vector<std::size_t>& indices, std::vector<T>& values) {
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i < lhs_nnz || j < rhs_nnz) {
+        std::size_t index;
+        T value;
+
+        if (j == rhs_nnz || (i < lhs_nnz && lhs_indices[i] < rhs_indices[j])) {
+            index = lhs_indices[i];
+            value = op(lhs_values[i++], T());
+        } else if (i == lhs_nnz || rhs_indices[j] < lhs_indices[i]) {
+            index = rhs_indices[j];
+            value = op(T(), rhs_values[j++]);
+        } else {
+            index = lhs_indices[i];
+            value = op(lhs_values[i++], rhs_values[j++]);
+        }
+
+        if (value != T()) {
+            indices.push_back(index);
+            values.push_back(value);
+        }
+    }
+}
+
+// Maps values[0 .. n) through f in place and returns how many of them
+// became zero. A plain pass over one contiguous array, so simple functions
+// get vectorized.
+template <typename T, typename F>
+std::size_t MapValues(T *values, std::size_t n, F f) {
+    std::size_t zeros = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        values[i] = f(values[i]);
+        zeros += values[i] == T();
+    }
+
+    return zeros;
+}
+
+// Moves the nonzero entries of [begin, end) of the parallel arrays down
+// to out, keeping their order. Returns the new end of the output.
+template <typename T>
+std::size_t CompactEntries(std::size_t *indices, T *values,
+                           std::size_t begin, std::size_t end, std::size_t out) {
+    for (std::size_t pos = begin; pos < end; pos++) {
+        if (values[pos] != T()) {
+            indices[out] = indices[pos];
+            values[out++] = values[pos];
+        }
+    }
+
+    return out;
+}
 
 template <typename T>
 class SparseVector {
@@ -100,14 +240,52 @@ public:
             if (index_ >= size_)
                 throw std::invalid_argument(ITER_OOB);
 
-            if (data_->find(index_) == data_->end()) {
+            const auto it = data_->find(index_);
+            if (it == data_->end()) {
                 return value_type();
-            } else {
-                return data_->at(index_);
             }
 
-            return value_type();
+            return it->second;
+        }
+    };
+
+    // Visits stored entries only, in increasing index order.
+    class NonZeroIter {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = SparseEntry<T>;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = void;
+        using reference         = value_type;
+
+        explicit NonZeroIter(typename map_type::const_iterator it)
+            : it_(it) {}
+
+        NonZeroIter& operator++() {
+            ++it_;
+            return *this;
+        }
+
+        NonZeroIter operator++(int) {
+            auto old = *this;
+            ++(*this);
+            return old;
+        }
+
+        bool operator==(const NonZeroIter& other) const {
+            return it_ == other.it_;
+        }
+
+        bool operator!=(const NonZeroIter& other) const {
+            return it_ != other.it_;
+        }
+
+        value_type operator*() const {
+            return { it_->first, it_->second };
         }
+
+    private:
+        typename map_type::const_iterator it_;
     };
 
 public:
@@ -174,9 +352,26 @@ public:
     bool operator==(const SparseVector<value_type>& other) const {
         if (size_ != other.size_) return false;
 
-        for (index_type i = 0; i < size_; i++) {
-            if (Get(i) != other.Get(i))
-                return false;
+        // operator[] may leave default values in the map, so a missing
+        // entry on one side matches a stored default on the other.
+        auto lhs = data_.begin();
+        auto rhs = other.data_.begin();
+        while (lhs != data_.end() || rhs != other.data_.end()) {
+            if (rhs == other.data_.end()
+                || (lhs != data_.end() && lhs->first < rhs->first)) {
+                if (lhs->second != value_type())
+                    return false;
+                ++lhs;
+            } else if (lhs == data_.end() || rhs->first < lhs->first) {
+                if (rhs->second != value_type())
+                    return false;
+                ++rhs;
+            } else {
+                if (lhs->second != rhs->second)
+                    return false;
+                ++lhs;
+                ++rhs;
+            }
         }
 
         return true;
@@ -194,6 +389,10 @@ public:
         return data_.size();
     }
 
+    IterRange<NonZeroIter> NonZeros() const {
+        return { NonZeroIter(data_.begin()), NonZeroIter(data_.end()) };
+    }
+
     Iter begin() {
         return Iter(0, &data_, size_);
     }
@@ -223,346 +422,2242 @@ private:
     map_type data_;
 };
 
-constexpr char MATRIX_SIZE_DIFFER        [] = "Matricies are of different sizes";
-constexpr char MATRIX_INVALID_SIZES      [] = "Matricies have invalid sizes for multiplication";
-constexpr char MATRIX_INVALID_INITIALIZER[] = "Invalid initializer list for a matrix";
-constexpr char MATRIX_MUST_BE_SQUARE     [] = "Mastrix must be square to perform this operation";
-
-inline int minus_one_pow(int pow) {
-    return (pow % 2 == 0) ? 1 : -1;
-}
-
-template<typename T>
-class SparseMatrixBase;
+// Same interface as SparseVector, but entries live in two parallel arrays
+// sorted by index. Lookups are binary searches, appends past the last entry
+// are amortized O(1) and element-wise operations merge the arrays directly.
+// Inserting into the middle shifts the tail, so it suits vectors that are
+// built once (ideally in index order) and then read many times.
+template <typename T>
+class FlatSparseVector {
+public:
+    using index_type = std::size_t;
+    using size_type  = std::size_t;
+    using value_type = T;
 
-template<typename T>
-SparseMatrixBase<T> MakeIdentityMatrix(std::size_t size);
+    // Walks every position like SparseVector::Iter, but keeps a cursor into
+    // the stored entries instead of searching on each dereference.
+    class Iter {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = FlatSparseVector<T>::value_type;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = value_type*;
+        using reference         = value_type&;
 
-template<typename T>
-std::ostream& operator<<(std::ostream& out, SparseMatrixBase<T> matrix);
+        explicit Iter(index_type index, const FlatSparseVector *vec)
+            : index_(index)
+            , pos_(vec->Find(index))
+            , vec_(vec) {}
 
-bool IsInsignificant(double num, double precision) {
-    return num < precision;
-}
+        Iter& operator++() {
+            if (pos_ < vec_->indices_.size() && vec_->indices_[pos_] == index_)
+                pos_++;
 
-bool IsEqual(double lhs, double rhs, double precision) {
-    return std::abs(lhs - rhs) <= precision;
-}
+            index_++;
+            return *this;
+        }
 
-template<typename T>
-class SparseMatrixBase {
-public:
-    using value_type = T;
-    using index_type = std::size_t;
-    using size_type = std::size_t;
-    using row_type = SparseVector<value_type>;
-    using container_type = SparseVector<row_type>;
+        Iter operator++(int) {
+            auto old = *this;
+            ++(*this);
+            return old;
+        }
 
-    enum Operation {
-        ADD,
-        SUBTRACT,
-        MULTIPLY,
-        DIVIDE
-    };
+        bool operator!=(const Iter& other) const {
+            return index_ != other.index_;
+        }
 
-    SparseMatrixBase() = delete;
-    SparseMatrixBase(size_type rows, size_type cols)
-        : rows_(rows)
-        , cols_(cols)
-        , data_(rows, row_type(cols)) {}
+        value_type operator*() const {
+            if (index_ >= vec_->size_)
+                throw std::invalid_argument(ITER_OOB);
 
-    SparseMatrixBase(std::initializer_list<std::initializer_list<value_type>> values)
-        : rows_(values.size())
-        , cols_(values.begin()->size())
-        , data_(rows_, row_type(cols_)) {
+            if (pos_ < vec_->indices_.size() && vec_->indices_[pos_] == index_)
+                return vec_->values_[pos_];
 
-        if (rows_ == 0 || cols_ == 0)
-            throw std::invalid_argument(MATRIX_INVALID_INITIALIZER);
+            return value_type();
+        }
 
-        index_type i = 0;
-        for (const auto& row : values ) {
-            index_type j = 0;
-            if (i >= rows_) {
-                break;
-            }
+    private:
+        index_type index_;
+        size_type pos_;
+        const FlatSparseVector *vec_;
+    };
 
-            for (const auto& el : row) {
-                if (j >= cols_)
-                    break;
+public:
+    FlatSparseVector(): size_(0) {}
+    explicit FlatSparseVector(size_type size): size_(size) {}
+    FlatSparseVector(size_type size, const value_type& value): size_(size) {
+        if (value == value_type())
+            return;
 
-                Set(i, j, el);
-                j++;
-            }
-            i++;
+        indices_.reserve(size_);
+        values_.assign(size_, value);
+        for (index_type i = 0; i < size_; i++) {
+            indices_.push_back(i);
         }
     }
 
-    SparseMatrixBase&
-    operator=(std::initializer_list<std::initializer_list<value_type>> values) {
-        *this = SparseMatrixBase(values);
-        return *this;
+    FlatSparseVector(const std::initializer_list<value_type>& values): size_(values.size()) {
+        index_type i = 0;
+        for (const auto& el : values) {
+            if (el != value_type())
+                PushBack(i, el);
+            i++;
+        }
     }
 
-    void Set(index_type row, index_type col, const value_type& value) {
-        if (row >= rows_) {
-            throw std::invalid_argument(ROW_OOB);
+    void Set(index_type index, const value_type& value) {
+        if (index >= size_) {
+            size_ = index + 1;
         }
 
-        if(col >= cols_) {
-            throw std::invalid_argument(COL_OOB);
-        }
+        const size_type pos = Find(index);
+        const bool found = pos < indices_.size() && indices_[pos] == index;
 
-        data_[row].Set(col, value);
-    }
+        if (value == value_type()) {
+            if (found) {
+                indices_.erase(indices_.begin() + pos);
+                values_.erase(values_.begin() + pos);
+            }
 
-    value_type Get(index_type row, index_type col) const {
-        if (row >= rows_) {
-            throw std::invalid_argument(ROW_OOB);
+            return;
         }
 
-        if(col >= cols_) {
-            throw std::invalid_argument(COL_OOB);
+        if (found) {
+            values_[pos] = value;
+            return;
         }
 
-        if (!data_.Has(row)) {
-            return value_type();
+        indices_.insert(indices_.begin() + pos, index);
+        values_.insert(values_.begin() + pos, value);
+    }
+
+    // Appends an entry past the last stored index in amortized O(1),
+    // falls back to Set otherwise.
+    void PushBack(index_type index, const value_type& value) {
+        if (!indices_.empty() && index <= indices_.back()) {
+            Set(index, value);
+            return;
         }
 
-        if (!data_.GetRef(row).Has(col)) {
-            return value_type();
+        if (index >= size_) {
+            size_ = index + 1;
         }
 
-        return data_.Get(row).Get(col);
+        indices_.push_back(index);
+        values_.push_back(value);
     }
 
-    bool operator==(const SparseMatrixBase& other) const {
-        if ((cols_ != other.cols_) || (rows_ != other.rows_)) {
-            return false;
+    void Reserve(size_type nnz) {
+        indices_.reserve(nnz);
+        values_.reserve(nnz);
+    }
+
+    value_type Get(index_type index) const {
+        if (index >= size_) {
+            throw std::invalid_argument(INDEX_OOB);
         }
 
-        return data_ == other.data_;
-    }
+        const size_type pos = Find(index);
+        if (pos < indices_.size() && indices_[pos] == index)
+            return values_[pos];
 
-    bool operator!=(const SparseMatrixBase& other) const {
-        return !(data_ == other.data_);
+        return value_type();
     }
 
-    bool IsSquare() const {
-        return cols_ == rows_;
+    bool Has(index_type index) const {
+        const size_type pos = Find(index);
+        return pos < indices_.size() && indices_[pos] == index;
     }
 
-    static bool CanMultiply(const SparseMatrixBase& lhs, const SparseMatrixBase& rhs) {
-    return lhs.Cols() == rhs.Rows();
+    // Position of the first entry with index not less than the given one,
+    // searched by binary search.
+    size_type Find(index_type index) const {
+        return std::lower_bound(indices_.begin(), indices_.end(), index) - indices_.begin();
     }
 
-    SparseMatrixBase operator+(const SparseMatrixBase& other) const {
-        if ((cols_ != other.cols_) || (rows_ != other.rows_)) {
-            throw std::invalid_argument(MATRIX_SIZE_DIFFER);
+    // Same as Find, but gallops forward from position from: the cost is
+    // O(log distance), which wins when consecutive lookups go in order.
+    size_type Find(index_type index, size_type from) const {
+        size_type step = 1;
+        size_type lo = from;
+        size_type hi = from;
+
+        while (hi < indices_.size() && indices_[hi] < index) {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
         }
 
-        SparseMatrixBase result(rows_, cols_);
-
-        for (index_type row = 0; row < rows_; row++) {
-            for (index_type col = 0; col < cols_; col++) {
-                result.Set(row, col, data_.Get(row).Get(col)
-                         + other.data_.Get(row).Get(col));
-            }
-        }
+        const auto first = indices_.begin() + lo;
+        const auto last  = indices_.begin() + std::min(hi, indices_.size());
 
-        return result;
+        return std::lower_bound(first, last, index) - indices_.begin();
     }
 
-    SparseMatrixBase operator-(const SparseMatrixBase& other) const {
-        if ((cols_ != other.cols_) || (rows_ != other.rows_)) {
-            throw std::invalid_argument(MATRIX_SIZE_DIFFER);
+    value_type Dot(const FlatSparseVector& other) const {
+        if (size_ != other.size_) {
+            throw std::invalid_argument(VECTOR_SIZE_DIFFER);
         }
 
-        SparseMatrixBase result(rows_, cols_);
+        // Gallop through the longer vector when the lengths differ a lot,
+        // plain merge otherwise.
+        const FlatSparseVector& shorter = RealSize() <= other.RealSize() ? *this : other;
+        const FlatSparseVector& longer  = RealSize() <= other.RealSize() ? other : *this;
+
+        value_type result = value_type();
+        if (shorter.RealSize() * 8 < longer.RealSize()) {
+            size_type pos = 0;
+            for (size_type i = 0; i < shorter.indices_.size(); i++) {
+                pos = longer.Find(shorter.indices_[i], pos);
+                if (pos == longer.indices_.size())
+                    break;
 
-        for (index_type row = 0; row < rows_; row++) {
-            for (index_type col = 0; col < cols_; col++) {
-                result.Set(row, col, data_.Get(row).Get(col)
-                         - other.data_.Get(row).Get(col));
+                if (longer.indices_[pos] == shorter.indices_[i])
+                    result += shorter.values_[i] * longer.values_[pos];
             }
-        }
-
-        return result;
-    }
 
+            return result;
+        }
 
-    SparseMatrixBase operator*(const SparseMatrixBase& other) const {
-        SparseMatrixBase result(rows_, other.cols_);
-
-        for (index_type row = 0; row < rows_; ++row) {
-            for (index_type col = 0; col < other.cols_; ++col) {
-                value_type sum = value_type();
-                for (index_type k = 0; k < cols_; ++k) {
-                    if (data_.GetRef(row).Has(k) && other.data_.GetRef(k).Has(col)) {
-                        sum += data_.Get(row).Get(k) * other.data_.Get(k).Get(col);
-                    }
-                }
-                if (sum != value_type()) {
-                    result.Set(row, col, sum);
-                }
-            }
+        size_type i = 0;
+        size_type j = 0;
+        while (i < indices_.size() && j < other.indices_.size()) {
+            if (indices_[i] < other.indices_[j]) {
+                i++;
+            } else if (other.indices_[j] < indices_[i]) {
+                j++;
+            } else {
+                result += values_[i++] * other.values_[j++];
             }
+        }
 
         return result;
     }
 
-    SparseMatrixBase operator*(const SparseVector<value_type>& vec) const {
-        SparseMatrixBase<value_type> vec_mat = FromVector(vec);
-        return (*this) * vec_mat;
+    FlatSparseVector operator+(const FlatSparseVector& other) const {
+        return Merge(other, std::plus<value_type>());
     }
 
-    SparseMatrixBase SubMatrix(index_type exclusion_row, index_type exclusion_col) const {
-        SparseMatrixBase result(rows_ - 1, cols_ - 1);
+    FlatSparseVector operator-(const FlatSparseVector& other) const {
+        return Merge(other, std::minus<value_type>());
+    }
 
-        int i = 0;
-        for (index_type row = 0; row < rows_; row++) {
-            int j = 0;
-            if (row == exclusion_row)
-                continue;
-            for (index_type col = 0; col < cols_; col++) {
-                if (col == exclusion_col)
-                    continue;
-                result.Set(i, j, Get(row, col));
-                j++;
-            }
-            i++;
-        }
+    bool operator==(const FlatSparseVector& other) const {
+        return size_ == other.size_
+            && indices_ == other.indices_
+            && values_ == other.values_;
+    }
 
-        return result;
+    bool operator!=(const FlatSparseVector& other) const {
+        return !(*this == other);
     }
 
-    SparseMatrixBase GetCol(index_type col) const {
-        SparseMatrixBase result(rows_, 1);
-        for (index_type i = 0; i < cols_; i++) {
+    size_type size() const {
+        return size_;
+    }
+
+    size_type RealSize() const {
+        return indices_.size();
+    }
+
+    const std::vector<index_type>& Indices() const {
+        return indices_;
+    }
+
+    const std::vector<value_type>& Values() const {
+        return values_;
+    }
+
+    // Maps every stored value through f in place, dropping the ones that
+    // become zero. Allocates nothing.
+    template<typename F>
+    void Transform(F f) {
+        if (MapValues(values_.data(), values_.size(), f) == 0)
+            return;
+
+        const size_type nnz = CompactEntries(indices_.data(), values_.data(), 0, values_.size(), 0);
+        indices_.resize(nnz);
+        values_.resize(nnz);
+    }
+
+    IterRange<ArrayEntryIter<value_type>> NonZeros() const {
+        return {
+            ArrayEntryIter<value_type>(indices_.data(), values_.data()),
+            ArrayEntryIter<value_type>(indices_.data() + indices_.size(),
+                                       values_.data() + values_.size())
+        };
+    }
+
+    Iter begin() const {
+        return Iter(0, this);
+    }
+
+    Iter end() const {
+        return Iter(size_, this);
+    }
+
+    Iter cbegin() const {
+        return begin();
+    }
+
+    Iter cend() const {
+        return end();
+    }
+
+private:
+    template<typename Op>
+    FlatSparseVector Merge(const FlatSparseVector& other, Op op) const {
+        if (size_ != other.size_) {
+            throw std::invalid_argument(VECTOR_SIZE_DIFFER);
+        }
+
+        FlatSparseVector result(size_);
+        result.Reserve(indices_.size() + other.indices_.size());
+
+        MergeSortedEntries(indices_.data(), values_.data(), indices_.size(),
+                           other.indices_.data(), other.values_.data(), other.indices_.size(),
+                           op, result.indices_, result.values_);
+
+        return result;
+    }
+
+    size_type size_;
+    std::vector<index_type> indices_;
+    std::vector<value_type> values_;
+};
+
+constexpr char MATRIX_SIZE_DIFFER        [] = "Matricies are of different sizes";
+constexpr char MATRIX_INVALID_SIZES      [] = "Matricies have invalid sizes for multiplication";
+constexpr char MATRIX_INVALID_INITIALIZER[] = "Invalid initializer list for a matrix";
+constexpr char MATRIX_MUST_BE_SQUARE     [] = "Mastrix must be square to perform this operation";
+constexpr char MATRIX_INVALID_CSR        [] = "Invalid compressed sparse row arrays";
+constexpr char MATRIX_NOT_COMPRESSED     [] = "Matrix is not compressed";
+constexpr char MATRIX_SEMIRING_OFFSET    [] = "Semiring products need matrices without an offset";
+
+// Below this many multiplications a product runs on the calling thread.
+constexpr std::size_t PARALLEL_MIN_FLOPS = 1 << 16;
+
+inline int minus_one_pow(int pow) {
+    return (pow % 2 == 0) ? 1 : -1;
+}
+
+template<typename T>
+class SparseMatrixBase;
+
+template<typename T>
+SparseMatrixBase<T> MakeIdentityMatrix(std::size_t size);
+
+template<typename T>
+class SparseMatrixBuilder;
+
+template<typename Semiring>
+class SemiringMatrix;
+
+template<typename T>
+std::ostream& operator<<(std::ostream& out, const SparseMatrixBase<T>& matrix);
+
+// Base of the lazy expression nodes in expr.hpp.
+struct MatrixExpression {};
+
+template<typename E>
+SparseMatrixBase<typename E::value_type> Evaluate(const E& expr, ThreadPool& pool = DefaultThreadPool());
+
+bool IsInsignificant(double num, double precision) {
+    return num < precision;
+}
+
+bool IsEqual(double lhs, double rhs, double precision) {
+    return std::abs(lhs - rhs) <= precision;
+}
+
+template<typename T>
+class SparseMatrixBase {
+public:
+    using value_type = T;
+    using index_type = std::size_t;
+    using size_type = std::size_t;
+    using row_type = FlatSparseVector<value_type>;
+    using container_type = std::vector<row_type>;
+
+    enum Operation {
+        ADD,
+        SUBTRACT,
+        MULTIPLY,
+        DIVIDE
+    };
+
+    // Compressed Sparse Row arrays. Entries of row i are stored at
+    // positions [row_ptr[i], row_ptr[i + 1]) of col_idx and values,
+    // sorted by column. Zeros are never stored.
+    struct CsrStorage {
+        std::vector<size_type>  row_ptr;
+        std::vector<index_type> col_idx;
+        std::vector<value_type> values;
+    };
+
+    // Stored entries of a row where they lie, be it the CSR arrays or the
+    // row's own arrays. Invalidated by any change of the matrix.
+    class RowView {
+    public:
+        using iterator = ArrayEntryIter<value_type>;
+
+        RowView(const index_type *indices, const value_type *values, size_type nnz)
+            : indices_(indices)
+            , values_(values)
+            , nnz_(nnz) {}
+
+        size_type RealSize() const {
+            return nnz_;
+        }
+
+        const index_type* Indices() const {
+            return indices_;
+        }
+
+        const value_type* Values() const {
+            return values_;
+        }
+
+        iterator begin() const {
+            return iterator(indices_, values_);
+        }
+
+        iterator end() const {
+            return iterator(indices_ + nnz_, values_ + nnz_);
+        }
+
+    private:
+        const index_type *indices_;
+        const value_type *values_;
+        size_type nnz_;
+    };
+
+    struct Entry {
+        index_type row;
+        index_type col;
+        const value_type& value;
+    };
+
+    // Visits stored entries only, row by row and by column inside a row.
+    class NonZeroIter {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = Entry;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = void;
+        using reference         = value_type;
+
+        explicit NonZeroIter(index_type row, const SparseMatrixBase *matrix)
+            : row_(row)
+            , matrix_(matrix)
+            , pos_(nullptr, nullptr)
+            , end_(nullptr, nullptr) {
+            SkipEmptyRows();
+        }
+
+        NonZeroIter& operator++() {
+            ++pos_;
+            if (pos_ == end_) {
+                row_++;
+                SkipEmptyRows();
+            }
+
+            return *this;
+        }
+
+        NonZeroIter operator++(int) {
+            auto old = *this;
+            ++(*this);
+            return old;
+        }
+
+        bool operator==(const NonZeroIter& other) const {
+            return row_ == other.row_ && pos_ == other.pos_;
+        }
+
+        bool operator!=(const NonZeroIter& other) const {
+            return !(*this == other);
+        }
+
+        value_type operator*() const {
+            const auto entry = *pos_;
+            return { row_, entry.index, entry.value };
+        }
+
+    private:
+        void SkipEmptyRows() {
+            for (; row_ < matrix_->rows_; row_++) {
+                const RowView row = matrix_->NonZeros(row_);
+                if (row.RealSize() != 0) {
+                    pos_ = row.begin();
+                    end_ = row.end();
+                    return;
+                }
+            }
+
+            pos_ = end_ = typename RowView::iterator(nullptr, nullptr);
+        }
+
+        index_type row_;
+        const SparseMatrixBase *matrix_;
+        typename RowView::iterator pos_;
+        typename RowView::iterator end_;
+    };
+
+    // Walks the rows as RowViews, nothing is copied.
+    class RowIter {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = RowView;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = value_type*;
+        using reference         = value_type&;
+
+        explicit RowIter(index_type row, const SparseMatrixBase *matrix)
+            : row_(row)
+            , matrix_(matrix) {}
+
+        RowIter& operator++() {
+            row_++;
+            return *this;
+        }
+
+        RowIter operator++(int) {
+            auto old = *this;
+            ++(*this);
+            return old;
+        }
+
+        bool operator!=(const RowIter& other) const {
+            return row_ != other.row_;
+        }
+
+        value_type operator*() const {
+            return matrix_->NonZeros(row_);
+        }
+
+    private:
+        index_type row_;
+        const SparseMatrixBase *matrix_;
+    };
+
+    SparseMatrixBase() = delete;
+    SparseMatrixBase(size_type rows, size_type cols)
+        : rows_(rows)
+        , cols_(cols)
+        , data_(rows, row_type(cols)) {}
+
+    // Takes ownership of ready CSR arrays, the result is compressed.
+    SparseMatrixBase(size_type rows, size_type cols, CsrStorage csr)
+        : rows_(rows)
+        , cols_(cols)
+        , compressed_(true)
+        , csr_(std::move(csr)) {
+
+        if (csr_.row_ptr.size() != rows_ + 1
+            || csr_.col_idx.size() != csr_.values.size()
+            || csr_.row_ptr.front() != 0
+            || csr_.row_ptr.back() != csr_.values.size()) {
+            throw std::invalid_argument(MATRIX_INVALID_CSR);
+        }
+    }
+
+    SparseMatrixBase(std::initializer_list<std::initializer_list<value_type>> values)
+        : rows_(values.size())
+        , cols_(values.begin()->size())
+        , data_(rows_, row_type(cols_)) {
+
+        if (rows_ == 0 || cols_ == 0)
+            throw std::invalid_argument(MATRIX_INVALID_INITIALIZER);
+
+        index_type i = 0;
+        for (const auto& row : values ) {
+            index_type j = 0;
+            if (i >= rows_) {
+                break;
+            }
+
+            for (const auto& el : row) {
+                if (j >= cols_)
+                    break;
+
+                Set(i, j, el);
+                j++;
+            }
+            i++;
+        }
+    }
+
+    // Evaluates a lazy expression, see expr.hpp.
+    template<typename E, typename = std::enable_if_t<std::is_base_of<MatrixExpression, E>::value>>
+    SparseMatrixBase(const E& expr)
+        : SparseMatrixBase(Evaluate(expr)) {}
+
+    SparseMatrixBase&
+    operator=(std::initializer_list<std::initializer_list<value_type>> values) {
+        *this = SparseMatrixBase(values);
+        return *this;
+    }
+
+    void Set(index_type row, index_type col, const value_type& value) {
+        if (row >= rows_) {
+            throw std::invalid_argument(ROW_OOB);
+        }
+
+        if(col >= cols_) {
+            throw std::invalid_argument(COL_OOB);
+        }
+
+        const value_type stored = value - offset_;
+
+        if (!compressed_) {
+            data_[row].Set(col, stored);
+            return;
+        }
+
+        // Overwriting an entry is cheap, inserting or removing one shifts
+        // the tail of the arrays. Uncompress() before massive updates.
+        const size_type pos = FindCompressed(row, col);
+        const bool found = pos < csr_.row_ptr[row + 1] && csr_.col_idx[pos] == col;
+
+        if (stored == value_type()) {
+            if (found) {
+                csr_.col_idx.erase(csr_.col_idx.begin() + pos);
+                csr_.values.erase(csr_.values.begin() + pos);
+                for (index_type i = row + 1; i <= rows_; i++) {
+                    csr_.row_ptr[i]--;
+                }
+            }
+
+            return;
+        }
+
+        if (found) {
+            csr_.values[pos] = stored;
+            return;
+        }
+
+        csr_.col_idx.insert(csr_.col_idx.begin() + pos, col);
+        csr_.values.insert(csr_.values.begin() + pos, stored);
+        for (index_type i = row + 1; i <= rows_; i++) {
+            csr_.row_ptr[i]++;
+        }
+    }
+
+    value_type Get(index_type row, index_type col) const {
+        if (row >= rows_) {
+            throw std::invalid_argument(ROW_OOB);
+        }
+
+        if(col >= cols_) {
+            throw std::invalid_argument(COL_OOB);
+        }
+
+        if (compressed_) {
+            const size_type pos = FindCompressed(row, col);
+            if (pos < csr_.row_ptr[row + 1] && csr_.col_idx[pos] == col) {
+                return csr_.values[pos] + offset_;
+            }
+
+            return offset_;
+        }
+
+        return data_[row].Get(col) + offset_;
+    }
+
+    // Compares the values of the cells exactly, a missing entry is the
+    // offset. Equal offsets mean equal stored entries, as zeros are never
+    // stored; otherwise the rows are merged like SparseMatrix does.
+    bool operator==(const SparseMatrixBase& other) const {
+        if ((cols_ != other.cols_) || (rows_ != other.rows_)) {
+            return false;
+        }
+
+        const bool offsets_equal = offset_ == other.offset_;
+        for (index_type row = 0; row < rows_; row++) {
+            const RowView lhs = NonZeros(row);
+            const RowView rhs = other.NonZeros(row);
+
+            if (offsets_equal) {
+                if (lhs.RealSize() != rhs.RealSize()
+                    || !std::equal(lhs.Indices(), lhs.Indices() + lhs.RealSize(), rhs.Indices())
+                    || !std::equal(lhs.Values(), lhs.Values() + lhs.RealSize(), rhs.Values())) {
+                    return false;
+                }
+                continue;
+            }
+
+            size_type i = 0;
+            size_type j = 0;
+            size_type visited = 0;
+            while (i < lhs.RealSize() || j < rhs.RealSize()) {
+                value_type lhs_value = offset_;
+                value_type rhs_value = other.offset_;
+                visited++;
+
+                if (j == rhs.RealSize() || (i < lhs.RealSize() && lhs.Indices()[i] < rhs.Indices()[j])) {
+                    lhs_value += lhs.Values()[i++];
+                } else if (i == lhs.RealSize() || rhs.Indices()[j] < lhs.Indices()[i]) {
+                    rhs_value += rhs.Values()[j++];
+                } else {
+                    lhs_value += lhs.Values()[i++];
+                    rhs_value += rhs.Values()[j++];
+                }
+
+                if (lhs_value != rhs_value) {
+                    return false;
+                }
+            }
+
+            // A cell missing in both holds the offsets, which differ.
+            if (visited < cols_) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool operator!=(const SparseMatrixBase& other) const {
+        return !(*this == other);
+    }
+
+    // Every cell holds its stored entry (zero if there is none) plus the
+    // offset, so adding a scalar to the whole matrix is O(1) and keeps it
+    // sparse. NonZeros, Csr, Row and RealSize see the stored entries only.
+    const value_type& Offset() const {
+        return offset_;
+    }
+
+    // Adds value to every cell.
+    SparseMatrixBase& Shift(const value_type& value) {
+        offset_ += value;
+        return *this;
+    }
+
+    // Stores every cell explicitly and resets the offset to zero, for code
+    // that only looks at the stored entries. O(rows * cols).
+    void ExpandOffset() {
+        if (offset_ == value_type())
+            return;
+
+        MapEveryCell([](const value_type& value) { return value; });
+    }
+
+    // Compound assignment. Scalar + and - only move the offset, scalar * and
+    // / are a single pass over the stored values.
+    // Updates the values where they are if this is compressed and every
+    // entry of other is already stored here, otherwise merges into new
+    // arrays.
+    SparseMatrixBase& operator+=(const SparseMatrixBase& other) {
+        if (!CombineInPlace(other, std::plus<value_type>()))
+            *this = Merge(other, std::plus<value_type>());
+
+        return *this;
+    }
+
+    SparseMatrixBase& operator-=(const SparseMatrixBase& other) {
+        if (!CombineInPlace(other, std::minus<value_type>()))
+            *this = Merge(other, std::minus<value_type>());
+
+        return *this;
+    }
+
+    SparseMatrixBase& operator*=(const SparseMatrixBase& other) {
+        return *this = Multiply(other, DefaultThreadPool());
+    }
+
+    SparseMatrixBase& operator+=(const value_type& value) {
+        return Shift(value);
+    }
+
+    SparseMatrixBase& operator-=(const value_type& value) {
+        return Shift(-value);
+    }
+
+    SparseMatrixBase& operator*=(const value_type& value) {
+        TransformStored([value](const value_type& entry) { return entry * value; });
+        offset_ *= value;
+        return *this;
+    }
+
+    SparseMatrixBase& operator/=(const value_type& value) {
+        TransformStored([value](const value_type& entry) { return entry / value; });
+        offset_ /= value;
+        return *this;
+    }
+
+    // Replaces every cell x by f(x) in place, visiting the stored entries
+    // only. A function with f(0) = 0 (scaling, pow, abs) maps the stored
+    // values directly. Otherwise f(offset) becomes the new offset and a
+    // stored s becomes f(s + offset) - f(offset), so the matrix stays sparse
+    // either way. Only if f(offset) is not finite every cell gets stored.
+    template<typename F>
+    SparseMatrixBase& Apply(F f) {
+        const value_type offset = offset_;
+        const value_type background = f(offset);
+
+        if (offset == value_type() && background == value_type()) {
+            TransformStored(f);
+            return *this;
+        }
+
+        if constexpr (std::is_floating_point<value_type>::value) {
+            if (!std::isfinite(background)) {
+                MapEveryCell(f);
+                return *this;
+            }
+        }
+
+        TransformStored([&](const value_type& entry) { return f(entry + offset) - background; });
+        offset_ = background;
+        return *this;
+    }
+
+    bool IsCompressed() const {
+        return compressed_;
+    }
+
+    // Switches the storage to CSR arrays, dropping the per-row arrays.
+    void Compress() {
+        if (compressed_)
+            return;
+
+        csr_ = BuildCsr();
+        data_ = container_type();
+        compressed_ = true;
+    }
+
+    // Switches the storage back to separate arrays per row, which are cheaper
+    // to update with Set.
+    void Uncompress() {
+        if (!compressed_)
+            return;
+
+        data_ = container_type(rows_, row_type(cols_));
+        for (index_type row = 0; row < rows_; row++) {
+            row_type& flat_row = data_[row];
+            flat_row.Reserve(csr_.row_ptr[row + 1] - csr_.row_ptr[row]);
+            for (size_type pos = csr_.row_ptr[row]; pos < csr_.row_ptr[row + 1]; pos++) {
+                flat_row.PushBack(csr_.col_idx[pos], csr_.values[pos]);
+            }
+        }
+
+        csr_ = CsrStorage();
+        compressed_ = false;
+    }
+
+    const CsrStorage& Csr() const {
+        if (!compressed_)
+            throw std::invalid_argument(MATRIX_NOT_COMPRESSED);
+
+        return csr_;
+    }
+
+    RowView NonZeros(index_type row) const {
+        if (row >= rows_)
+            throw std::invalid_argument(ROW_OOB);
+
+        if (compressed_) {
+            const size_type first = csr_.row_ptr[row];
+            return RowView(csr_.col_idx.data() + first, csr_.values.data() + first,
+                           csr_.row_ptr[row + 1] - first);
+        }
+
+        const row_type& flat_row = data_[row];
+        return RowView(flat_row.Indices().data(), flat_row.Values().data(),
+                       flat_row.RealSize());
+    }
+
+    IterRange<NonZeroIter> NonZeros() const {
+        return { NonZeroIter(0, this), NonZeroIter(rows_, this) };
+    }
+
+    // A copy of the stored entries of a row, NonZeros(row) reads them in
+    // place.
+    row_type Row(index_type row) const {
+        if (row >= rows_)
+            throw std::invalid_argument(ROW_OOB);
+
+        if (!compressed_)
+            return data_[row];
+
+        row_type result(cols_);
+        for (size_type pos = csr_.row_ptr[row]; pos < csr_.row_ptr[row + 1]; pos++) {
+            result.PushBack(csr_.col_idx[pos], csr_.values[pos]);
+        }
+
+        return result;
+    }
+
+    bool IsSquare() const {
+        return cols_ == rows_;
+    }
+
+    static bool CanMultiply(const SparseMatrixBase& lhs, const SparseMatrixBase& rhs) {
+    return lhs.Cols() == rhs.Rows();
+    }
+
+    SparseMatrixBase operator+(const SparseMatrixBase& other) const& {
+        return Merge(other, std::plus<value_type>());
+    }
+
+    // An expiring left operand is updated in place when it can, see +=.
+    SparseMatrixBase operator+(const SparseMatrixBase& other) && {
+        *this += other;
+        return std::move(*this);
+    }
+
+    SparseMatrixBase operator-(const SparseMatrixBase& other) const& {
+        return Merge(other, std::minus<value_type>());
+    }
+
+    SparseMatrixBase operator-(const SparseMatrixBase& other) && {
+        *this -= other;
+        return std::move(*this);
+    }
+
+    SparseMatrixBase operator*(const SparseMatrixBase& other) const {
+        return Multiply(other, DefaultThreadPool());
+    }
+
+    // Gustavson's algorithm: row i of the result is the sum of the rows of
+    // other picked by the nonzeros of row i, scaled by them. Output rows are
+    // independent, so they are computed in parallel: rows are cut into a
+    // few chunks per thread with about the same number of multiplications,
+    // threads take chunks from the pool and write them into their own
+    // arrays, then every chunk is copied to its final offset. Every thread
+    // keeps one accumulator for all the rows it computes.
+    SparseMatrixBase Multiply(const SparseMatrixBase& other, ThreadPool& pool) const {
+        SparseMatrixBase product = MultiplyStored<PlusTimes<value_type>>(other, pool);
+        if (offset_ == value_type() && other.offset_ == value_type())
+            return product;
+
+        return AddOffsetProducts(std::move(product), *this, other);
+    }
+
+    // The product over a semiring (see semiring.hpp), by the same parallel
+    // Gustavson kernel: a.Multiply<MinPlus<double>>(b) gives the shortest
+    // paths of two steps. Cells that are not stored are the semiring's
+    // Zero(), so the matrices must not have an offset, and the result is a
+    // SemiringMatrix whose missing cells are Zero() too.
+    template<typename Semiring>
+    SemiringMatrix<Semiring> Multiply(const SparseMatrixBase& other, ThreadPool& pool = DefaultThreadPool()) const {
+        if (offset_ != value_type() || other.offset_ != value_type()) {
+            throw std::invalid_argument(MATRIX_SEMIRING_OFFSET);
+        }
+
+        return SemiringMatrix<Semiring>(MultiplyStored<Semiring>(other, pool));
+    }
+
+    // y = A * x over a semiring, every y[i] sums the stored entries of row
+    // i times the matching x starting from Zero(). Rows run in parallel.
+    template<typename Semiring>
+    void Multiply(const std::vector<value_type>& x, std::vector<value_type>& y,
+                  ThreadPool& pool = DefaultThreadPool()) const {
+        if (x.size() != cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        if (offset_ != value_type()) {
+            throw std::invalid_argument(MATRIX_SEMIRING_OFFSET);
+        }
+
+        y.resize(rows_);
+        const std::vector<index_type> bounds = RowBlocks(pool.Threads());
+        pool.Run(bounds.size() - 1, [&](size_type block) {
+            for (index_type row = bounds[block]; row < bounds[block + 1]; row++) {
+                y[row] = RowDot<Semiring>(row, x.data());
+            }
+        });
+    }
+
+    template<typename Semiring>
+    std::vector<value_type> Multiply(const std::vector<value_type>& x,
+                                     ThreadPool& pool = DefaultThreadPool()) const {
+        std::vector<value_type> result;
+        Multiply<Semiring>(x, result, pool);
+        return result;
+    }
+
+
+    // Fused c = alpha * this * other + beta * c, the step of an iterative
+    // update without the temporaries of a * b * alpha + c * beta. Every row
+    // of the product is accumulated once and added straight into c: rows
+    // whose pattern in c already holds the product's are updated in place,
+    // so an unchanged pattern allocates nothing, and only the rows that
+    // grow are merged into new arrays. c ends up compressed. A zero beta
+    // ignores the old values of c. Operands with an offset, or c being one
+    // of them, go through Multiply.
+    void MultiplyAdd(const value_type& alpha, const SparseMatrixBase& other, const value_type& beta,
+                     SparseMatrixBase& c, ThreadPool& pool = DefaultThreadPool()) const {
+        if (!CanMultiply(*this, other) || c.rows_ != rows_ || c.cols_ != other.cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        if (offset_ != value_type() || other.offset_ != value_type() || &c == this || &c == &other) {
+            SparseMatrixBase product = Multiply(other, pool);
+            product *= alpha;
+            c.ScaleOutput(beta);
+            c += product;
+            return;
+        }
+
+        c.Compress();
+        if (alpha == value_type()) {
+            c.ScaleOutput(beta);
+            return;
+        }
+
+        const std::vector<index_type> bounds = ProductChunks(other, pool);
+        CsrStorage& out = c.csr_;
+
+        // Rows that outgrow the pattern of c go to their chunk's arrays.
+        std::vector<char> grown(rows_);
+        std::vector<size_type> grown_end(rows_);
+        std::vector<std::vector<index_type>> chunk_cols(bounds.size() - 1);
+        std::vector<std::vector<value_type>> chunk_values(bounds.size() - 1);
+        std::vector<std::unique_ptr<RowAccumulator<>>> accumulators(pool.Threads());
+
+        pool.Run(bounds.size() - 1, [&](size_type chunk) {
+            auto& accumulator = accumulators[ThreadPool::CurrentThread()];
+            if (!accumulator) {
+                accumulator = std::make_unique<RowAccumulator<>>(other.cols_);
+            }
+
+            for (index_type row = bounds[chunk]; row < bounds[chunk + 1]; row++) {
+                const RowView lhs = NonZeros(row);
+                for (size_type i = 0; i < lhs.RealSize(); i++) {
+                    const RowView rhs = other.NonZeros(lhs.Indices()[i]);
+                    const value_type scale = lhs.Values()[i];
+                    for (size_type j = 0; j < rhs.RealSize(); j++) {
+                        accumulator->Add(rhs.Indices()[j], scale * rhs.Values()[j]);
+                    }
+                }
+
+                const size_type begin = out.row_ptr[row];
+                const size_type nnz = out.row_ptr[row + 1] - begin;
+                if (accumulator->Within(out.col_idx.data() + begin, nnz)) {
+                    accumulator->FlushInto(alpha, beta, out.col_idx.data() + begin,
+                                           out.values.data() + begin, nnz);
+                    continue;
+                }
+
+                grown[row] = true;
+                accumulator->FlushMerged(alpha, beta, out.col_idx.data() + begin,
+                                         out.values.data() + begin, nnz,
+                                         chunk_cols[chunk], chunk_values[chunk]);
+                grown_end[row] = chunk_values[chunk].size();
+            }
+        });
+
+        c.offset_ = detail::GemmScaled(beta, c.offset_);
+
+        if (std::find(grown.begin(), grown.end(), true) == grown.end()) {
+            c.DropStoredZeros();
+            return;
+        }
+
+        CsrStorage merged;
+        merged.row_ptr.reserve(rows_ + 1);
+        merged.row_ptr.push_back(0);
+        for (size_type chunk = 0; chunk + 1 < bounds.size(); chunk++) {
+            size_type grown_begin = 0;
+            for (index_type row = bounds[chunk]; row < bounds[chunk + 1]; row++) {
+                if (grown[row]) {
+                    merged.col_idx.insert(merged.col_idx.end(),
+                                          chunk_cols[chunk].begin() + grown_begin,
+                                          chunk_cols[chunk].begin() + grown_end[row]);
+                    merged.values.insert(merged.values.end(),
+                                         chunk_values[chunk].begin() + grown_begin,
+                                         chunk_values[chunk].begin() + grown_end[row]);
+                    grown_begin = grown_end[row];
+                } else {
+                    for (size_type pos = out.row_ptr[row]; pos < out.row_ptr[row + 1]; pos++) {
+                        if (out.values[pos] != value_type()) {
+                            merged.col_idx.push_back(out.col_idx[pos]);
+                            merged.values.push_back(out.values[pos]);
+                        }
+                    }
+                }
+                merged.row_ptr.push_back(merged.values.size());
+            }
+        }
+
+        out = std::move(merged);
+    }
+
+    // Fused c = alpha * this * other + beta * c into a dense c. Every
+    // product of stored entries is added straight into its cell, rows of c
+    // are computed in parallel. Offsets add the column sums of other and the
+    // row sums of this, as in AddOffsetProducts.
+    void MultiplyAdd(const value_type& alpha, const SparseMatrixBase& other, const value_type& beta,
+                     VectorMatrix<value_type>& c, ThreadPool& pool = DefaultThreadPool()) const {
+        if (!CanMultiply(*this, other) || c.Rows() != rows_ || c.Cols() != other.cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        std::vector<value_type> col_shifts;
+        if (offset_ != value_type()) {
+            col_shifts.resize(other.cols_);
+            for (const auto [row, col, value] : other.NonZeros()) {
+                col_shifts[col] += value;
+            }
+            for (value_type& shift : col_shifts) {
+                shift *= alpha * offset_;
+            }
+        }
+
+        std::vector<value_type> row_shifts;
+        if (other.offset_ != value_type()) {
+            row_shifts.resize(rows_);
+            for (const auto [row, col, value] : NonZeros()) {
+                row_shifts[row] += value;
+            }
+            const value_type corner = offset_ * static_cast<value_type>(cols_);
+            for (value_type& shift : row_shifts) {
+                shift = alpha * other.offset_ * (shift + corner);
+            }
+        }
+
+        const std::vector<index_type> bounds = ProductChunks(other, pool);
+        pool.Run(bounds.size() - 1, [&](size_type chunk) {
+            for (index_type row = bounds[chunk]; row < bounds[chunk + 1]; row++) {
+                value_type *result = c.RowData(row);
+                for (index_type col = 0; col < other.cols_; col++) {
+                    result[col] = detail::GemmScaled(beta, result[col]);
+                }
+
+                const RowView lhs = NonZeros(row);
+                for (size_type i = 0; i < lhs.RealSize(); i++) {
+                    const RowView rhs = other.NonZeros(lhs.Indices()[i]);
+                    const value_type scale = alpha * lhs.Values()[i];
+                    for (size_type j = 0; j < rhs.RealSize(); j++) {
+                        result[rhs.Indices()[j]] += scale * rhs.Values()[j];
+                    }
+                }
+
+                if (!col_shifts.empty()) {
+                    for (index_type col = 0; col < other.cols_; col++) {
+                        result[col] += col_shifts[col];
+                    }
+                }
+
+                if (!row_shifts.empty()) {
+                    for (index_type col = 0; col < other.cols_; col++) {
+                        result[col] += row_shifts[row];
+                    }
+                }
+            }
+        });
+    }
+
+    VectorMatrix<value_type> operator*(const VectorMatrix<value_type>& dense) const {
+        return Multiply(dense, DefaultThreadPool());
+    }
+
+    VectorMatrix<value_type> Multiply(const VectorMatrix<value_type>& dense, ThreadPool& pool) const {
+        VectorMatrix<value_type> result(rows_, dense.Cols());
+        MultiplyAdd(value_type(1), dense, value_type(), result, pool);
+        return result;
+    }
+
+    // Sparse times dense, c = alpha * this * b + beta * c. Row i of c is the
+    // sum of the rows of b picked by the nonzeros of row i: every stored
+    // entry is read once and updates a whole contiguous row of c with a SIMD
+    // axpy, so its index is loaded once for all the columns of b. Rows of c
+    // are computed in parallel, in blocks with about the same number of
+    // entries. The offset adds its multiple of the column sums of b.
+    void MultiplyAdd(const value_type& alpha, const VectorMatrix<value_type>& b, const value_type& beta,
+                     VectorMatrix<value_type>& c, ThreadPool& pool = DefaultThreadPool()) const {
+        if (cols_ != b.Rows() || c.Rows() != rows_ || c.Cols() != b.Cols()) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        const size_type n = b.Cols();
+        const detail::AxpyKernel<value_type> axpy = detail::SelectAxpyKernel<value_type>();
+
+        std::vector<value_type> col_sums;
+        if (offset_ != value_type()) {
+            col_sums.resize(n);
+            for (index_type row = 0; row < b.Rows(); row++) {
+                axpy(n, value_type(1), b.RowData(row), col_sums.data());
+            }
+        }
+
+        const size_type blocks = RealSize() * n < PARALLEL_MIN_FLOPS ? 1 : pool.Threads() * 4;
+        const std::vector<index_type> bounds = RowBlocks(blocks);
+        pool.Run(bounds.size() - 1, [&](size_type block) {
+            for (index_type row = bounds[block]; row < bounds[block + 1]; row++) {
+                value_type *result = c.RowData(row);
+                for (index_type col = 0; col < n; col++) {
+                    result[col] = detail::GemmScaled(beta, result[col]);
+                }
+
+                const RowView lhs = NonZeros(row);
+                for (size_type i = 0; i < lhs.RealSize(); i++) {
+                    axpy(n, alpha * lhs.Values()[i], b.RowData(lhs.Indices()[i]), result);
+                }
+
+                if (!col_sums.empty()) {
+                    axpy(n, alpha * offset_, col_sums.data(), result);
+                }
+            }
+        });
+    }
+
+    // The product as a rows x 1 matrix.
+    SparseMatrixBase operator*(const SparseVector<value_type>& vec) const {
+        if (vec.size() != cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        std::vector<value_type> dense(cols_);
+        for (const auto [index, value] : vec.NonZeros()) {
+            dense[index] = value;
+        }
+
+        CsrStorage result;
+        result.row_ptr.reserve(rows_ + 1);
+        result.row_ptr.push_back(0);
+
+        const value_type shift = OffsetDot(dense.data());
+        for (index_type row = 0; row < rows_; row++) {
+            const value_type sum = RowDot(row, dense.data()) + shift;
+            if (sum != value_type()) {
+                result.col_idx.push_back(0);
+                result.values.push_back(sum);
+            }
+            result.row_ptr.push_back(result.values.size());
+        }
+
+        return SparseMatrixBase(rows_, 1, std::move(result));
+    }
+
+    std::vector<value_type> operator*(const std::vector<value_type>& vec) const {
+        std::vector<value_type> result;
+        Multiply(vec, result);
+        return result;
+    }
+
+    FlatSparseVector<value_type> operator*(const FlatSparseVector<value_type>& vec) const {
+        FlatSparseVector<value_type> result;
+        Multiply(vec, result);
+        return result;
+    }
+
+    // Matrix-vector products y = A * x in O(rows + nnz), reading the rows
+    // where they are stored. y is overwritten and only reallocated if it has
+    // the wrong size. A sparse x is first scattered into a dense array.
+    void Multiply(const std::vector<value_type>& x, std::vector<value_type>& y) const {
+        if (x.size() != cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        y.resize(rows_);
+        const value_type shift = OffsetDot(x.data());
+        for (index_type row = 0; row < rows_; row++) {
+            y[row] = RowDot(row, x.data()) + shift;
+        }
+    }
+
+    void Multiply(const std::vector<value_type>& x, FlatSparseVector<value_type>& y) const {
+        if (x.size() != cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        y = FlatSparseVector<value_type>(rows_);
+        const value_type shift = OffsetDot(x.data());
+        for (index_type row = 0; row < rows_; row++) {
+            const value_type sum = RowDot(row, x.data()) + shift;
+            if (sum != value_type()) {
+                y.PushBack(row, sum);
+            }
+        }
+    }
+
+    void Multiply(const FlatSparseVector<value_type>& x, std::vector<value_type>& y) const {
+        Multiply(ToDense(x), y);
+    }
+
+    void Multiply(const FlatSparseVector<value_type>& x, FlatSparseVector<value_type>& y) const {
+        Multiply(ToDense(x), y);
+    }
+
+    // Parallel y = A * x on the pool. Rows are split into one block per
+    // thread by number of entries rather than number of rows.
+    void Multiply(const std::vector<value_type>& x, std::vector<value_type>& y,
+                  ThreadPool& pool) const {
+        if (x.size() != cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        y.resize(rows_);
+        const value_type shift = OffsetDot(x.data());
+
+        const std::vector<index_type> bounds = RowBlocks(pool.Threads());
+        pool.Run(bounds.size() - 1, [&](size_type block) {
+            for (index_type row = bounds[block]; row < bounds[block + 1]; row++) {
+                y[row] = RowDot(row, x.data()) + shift;
+            }
+        });
+    }
+
+    // y = A^k * x by k products, A^k itself is never formed. The matrix
+    // must be square; k = 0 copies x.
+    void PowerMultiply(size_type k, const std::vector<value_type>& x, std::vector<value_type>& y,
+                       ThreadPool& pool = DefaultThreadPool()) const {
+        if (!IsSquare()) {
+            throw std::invalid_argument(MATRIX_MUST_BE_SQUARE);
+        }
+
+        if (x.size() != cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        y = x;
+        std::vector<value_type> next(rows_);
+        for (size_type step = 0; step < k; step++) {
+            Multiply(y, next, pool);
+            y.swap(next);
+        }
+    }
+
+    std::vector<value_type> PowerMultiply(size_type k, const std::vector<value_type>& x) const {
+        std::vector<value_type> result;
+        PowerMultiply(k, x, result);
+        return result;
+    }
+
+    SparseMatrixBase SubMatrix(index_type exclusion_row, index_type exclusion_col) const {
+        SparseMatrixBuilder<value_type> result(rows_ - 1, cols_ - 1);
+        result.Reserve(RealSize());
+
+        for (const auto [row, col, value] : NonZeros()) {
+            if (row == exclusion_row || col == exclusion_col)
+                continue;
+
+            result.Add(row - (row > exclusion_row), col - (col > exclusion_col), value);
+        }
+
+        SparseMatrixBase sub = result.Build();
+        sub.offset_ = offset_;
+        return sub;
+    }
+
+    SparseMatrixBase GetCol(index_type col) const {
+        SparseMatrixBase result(rows_, 1);
+        for (index_type i = 0; i < cols_; i++) {
             result.Set(i, 0, Get(i, col));
         }
 
-        return result;
-    }
+        return result;
+    }
+
+    SparseMatrixBase& RowOperation(index_type row, const value_type& value, Operation op) {
+        if (row >= rows_)
+            throw std::invalid_argument(INDEX_OOB);
+
+        for (index_type i = 0; i < cols_; i++) {
+            switch (op) {
+                case ADD:
+                    Set(row, i, Get(row, i) + value);
+                    break;
+                case SUBTRACT:
+                    Set(row, i, Get(row, i) - value);
+                    break;
+                case MULTIPLY:
+                    Set(row, i, Get(row, i) * value);
+                    break;
+                case DIVIDE:
+                    Set(row, i, Get(row, i) / value);
+                    break;
+            }
+        }
+
+        return *this;
+    }
+
+    SparseMatrixBase& ColOperation(index_type col, const value_type& value, Operation op) {
+        if (col >= cols_)
+            throw std::invalid_argument(INDEX_OOB);
+
+        for (index_type i = 0; i < rows_; i++) {
+            switch (op) {
+                case ADD:
+                    Set(i, col, Get(i, col) + value);
+                    break;
+                case SUBTRACT:
+                    Set(i, col, Get(i, col) - value);
+                    break;
+                case MULTIPLY:
+                    Set(i, col, Get(i, col) * value);
+                    break;
+                case DIVIDE:
+                    Set(i, col, Get(i, col) / value);
+                    break;
+            }
+        }
+
+        return *this;
+    }
+
+    SparseMatrixBase Transpose() const {
+        ThreadPool serial(1);
+        return Transpose(serial);
+    }
+
+    // Counting sort of the entries by column: count the entries of every
+    // column, turn the counts into offsets with a prefix sum, then scatter.
+    // In parallel every thread counts and scatters its own block of rows,
+    // the offsets keep the blocks in row order inside every column.
+    SparseMatrixBase Transpose(ThreadPool& pool) const {
+        const size_type nnz = RealSize();
+
+        const std::vector<index_type> bounds = RowBlocks(pool.Threads());
+        const size_type threads = bounds.size() - 1;
+
+        std::vector<std::vector<size_type>> offsets(threads, std::vector<size_type>(cols_));
+
+        pool.Run(threads, [&](size_type t) {
+            std::vector<size_type>& count = offsets[t];
+            for (index_type row = bounds[t]; row < bounds[t + 1]; row++) {
+                const RowView view = NonZeros(row);
+                for (size_type pos = 0; pos < view.RealSize(); pos++) {
+                    count[view.Indices()[pos]]++;
+                }
+            }
+        });
+
+        CsrStorage result;
+        result.row_ptr.resize(cols_ + 1);
+        result.col_idx.resize(nnz);
+        result.values.resize(nnz);
+
+        size_type running = 0;
+        for (index_type col = 0; col < cols_; col++) {
+            result.row_ptr[col] = running;
+            for (size_type t = 0; t < threads; t++) {
+                const size_type count = offsets[t][col];
+                offsets[t][col] = running;
+                running += count;
+            }
+        }
+        result.row_ptr[cols_] = running;
+
+        pool.Run(threads, [&](size_type t) {
+            std::vector<size_type>& next = offsets[t];
+            for (index_type row = bounds[t]; row < bounds[t + 1]; row++) {
+                const RowView view = NonZeros(row);
+                for (size_type pos = 0; pos < view.RealSize(); pos++) {
+                    const size_type dest = next[view.Indices()[pos]]++;
+                    result.col_idx[dest] = row;
+                    result.values[dest] = view.Values()[pos];
+                }
+            }
+        });
+
+        SparseMatrixBase transposed(cols_, rows_, std::move(result));
+        transposed.offset_ = offset_;
+        return transposed;
+    }
+
+    size_type RealSize() const {
+        if (compressed_)
+            return csr_.values.size();
+
+        size_type rsize = 0;
+        for (const auto& row : data_) {
+            rsize += row.RealSize();
+        }
+
+        return rsize;
+    }
+
+    size_type Cols() const {
+        return cols_;
+    }
+
+    size_type Rows() const {
+        return rows_;
+    }
+
+    RowIter begin() const {
+        return RowIter(0, this);
+    }
+
+    RowIter end() const {
+        return RowIter(rows_, this);
+    }
+
+    RowIter cbegin() const {
+        return begin();
+    }
+
+    RowIter cend() const {
+        return end();
+    }
+
+    size_type size() const;
+
+    static SparseMatrixBase<value_type> FromVector(const SparseVector<value_type>& vec) {
+        SparseMatrixBase<value_type> result(vec.size(), 1);
+
+        for (int i = 0; i < vec.size(); i++) {
+            result.Set(i, 0, vec.Get(i));
+        }
+
+        return result;
+    }
+protected:
+    // this = op(this, other) on the stored values, if this is compressed and
+    // the pattern of other is a subset of its own. Same op rules as Merge.
+    template<typename Op>
+    bool CombineInPlace(const SparseMatrixBase& other, Op op) {
+        if ((cols_ != other.cols_) || (rows_ != other.rows_)) {
+            throw std::invalid_argument(MATRIX_SIZE_DIFFER);
+        }
+
+        if (!compressed_)
+            return false;
+
+        for (index_type row = 0; row < rows_; row++) {
+            const RowView rhs = other.NonZeros(row);
+            const index_type *first = csr_.col_idx.data() + csr_.row_ptr[row];
+            const index_type *last = csr_.col_idx.data() + csr_.row_ptr[row + 1];
+            if (!std::includes(first, last, rhs.Indices(), rhs.Indices() + rhs.RealSize()))
+                return false;
+        }
+
+        size_type zeros = 0;
+        for (index_type row = 0; row < rows_; row++) {
+            const RowView rhs = other.NonZeros(row);
+            size_type pos = csr_.row_ptr[row];
+            for (size_type i = 0; i < rhs.RealSize(); i++) {
+                while (csr_.col_idx[pos] != rhs.Indices()[i]) {
+                    pos++;
+                }
+
+                csr_.values[pos] = op(csr_.values[pos], rhs.Values()[i]);
+                zeros += csr_.values[pos] == value_type();
+            }
+        }
+
+        offset_ = op(offset_, other.offset_);
+
+        if (zeros != 0) {
+            DropStoredZeros();
+        }
+
+        return true;
+    }
+
+    // Element-wise op over the union of both sparsity patterns, merging the
+    // sorted rows of the operands. Implicit zeros are never visited. The op
+    // must be linear (+ or -) for the offsets to combine the same way.
+    template<typename Op>
+    SparseMatrixBase Merge(const SparseMatrixBase& other, Op op) const {
+        if ((cols_ != other.cols_) || (rows_ != other.rows_)) {
+            throw std::invalid_argument(MATRIX_SIZE_DIFFER);
+        }
+
+        CsrStorage result;
+        result.row_ptr.reserve(rows_ + 1);
+        result.row_ptr.push_back(0);
+        result.col_idx.reserve(RealSize() + other.RealSize());
+        result.values.reserve(RealSize() + other.RealSize());
+
+        for (index_type row = 0; row < rows_; row++) {
+            const RowView lhs = NonZeros(row);
+            const RowView rhs = other.NonZeros(row);
+
+            MergeSortedEntries(lhs.Indices(), lhs.Values(), lhs.RealSize(),
+                               rhs.Indices(), rhs.Values(), rhs.RealSize(),
+                               op, result.col_idx, result.values);
+
+            result.row_ptr.push_back(result.values.size());
+        }
+
+        SparseMatrixBase merged(rows_, cols_, std::move(result));
+        merged.offset_ = op(offset_, other.offset_);
+        return merged;
+    }
+
+    // (S + a J) * (T + b J), J being all ones, is S * T + a J T + b S J
+    // + a b k J: every row gets a times the column sums of T, every column
+    // b times the row sums of S. Only the rows and columns where those are
+    // nonzero get filled, the last term becomes the offset.
+    static SparseMatrixBase AddOffsetProducts(SparseMatrixBase product, const SparseMatrixBase& lhs,
+                                              const SparseMatrixBase& rhs) {
+        const value_type a = lhs.offset_;
+        const value_type b = rhs.offset_;
+
+        std::vector<value_type> col_sums(rhs.cols_);
+        for (const auto [row, col, value] : rhs.NonZeros()) {
+            col_sums[col] += value;
+        }
+
+        std::vector<value_type> row_sums(lhs.rows_);
+        for (const auto [row, col, value] : lhs.NonZeros()) {
+            row_sums[row] += value;
+        }
+
+        std::vector<index_type> shifted_cols;
+        for (index_type col = 0; col < rhs.cols_; col++) {
+            col_sums[col] *= a;
+            if (col_sums[col] != value_type())
+                shifted_cols.push_back(col);
+        }
+
+        SparseMatrixBuilder<value_type> builder(product.rows_, product.cols_);
+        builder.Reserve(product.RealSize());
+        for (const auto [row, col, value] : product.NonZeros()) {
+            builder.Add(row, col, value);
+        }
+
+        for (index_type row = 0; row < product.rows_; row++) {
+            const value_type row_shift = b * row_sums[row];
+            if (row_shift == value_type()) {
+                for (index_type col : shifted_cols) {
+                    builder.Add(row, col, col_sums[col]);
+                }
+                continue;
+            }
+
+            for (index_type col = 0; col < product.cols_; col++) {
+                builder.Add(row, col, col_sums[col] + row_shift);
+            }
+        }
+
+        SparseMatrixBase result = builder.Build();
+        result.offset_ = a * b * static_cast<value_type>(lhs.cols_);
+        return result;
+    }
+
+    // this = beta * this. A zero beta clears the matrix without reading it.
+    void ScaleOutput(const value_type& beta) {
+        if (beta != value_type()) {
+            *this *= beta;
+            return;
+        }
+
+        Compress();
+        std::fill(csr_.row_ptr.begin(), csr_.row_ptr.end(), 0);
+        csr_.col_idx.clear();
+        csr_.values.clear();
+        offset_ = value_type();
+    }
+
+    // Contribution of the offset to every entry of A * x.
+    value_type OffsetDot(const value_type *x) const {
+        if (offset_ == value_type())
+            return value_type();
+
+        value_type sum = value_type();
+        for (index_type col = 0; col < cols_; col++) {
+            sum += x[col];
+        }
+
+        return offset_ * sum;
+    }
+
+    // Maps every stored entry through f in place, dropping the ones that
+    // become zero. The offset is left alone.
+    template<typename F>
+    void TransformStored(F f) {
+        if (!compressed_) {
+            for (row_type& row : data_) {
+                row.Transform(f);
+            }
+
+            return;
+        }
+
+        if (MapValues(csr_.values.data(), csr_.values.size(), f) != 0) {
+            DropStoredZeros();
+        }
+    }
+
+    // Removes the zeros from the CSR arrays, which must be in use.
+    void DropStoredZeros() {
+        size_type out = 0;
+        size_type begin = 0;
+        for (index_type row = 0; row < rows_; row++) {
+            const size_type end = csr_.row_ptr[row + 1];
+            out = CompactEntries(csr_.col_idx.data(), csr_.values.data(), begin, end, out);
+            begin = end;
+            csr_.row_ptr[row + 1] = out;
+        }
+
+        csr_.col_idx.resize(out);
+        csr_.values.resize(out);
+    }
+
+    // Stores f of every cell and resets the offset, O(rows * cols).
+    template<typename F>
+    void MapEveryCell(F f) {
+        CsrStorage result;
+        result.row_ptr.reserve(rows_ + 1);
+        result.row_ptr.push_back(0);
+
+        for (index_type row = 0; row < rows_; row++) {
+            const RowView view = NonZeros(row);
+            size_type pos = 0;
+            for (index_type col = 0; col < cols_; col++) {
+                value_type value = offset_;
+                if (pos < view.RealSize() && view.Indices()[pos] == col) {
+                    value += view.Values()[pos++];
+                }
+
+                value = f(value);
+                if (value != value_type()) {
+                    result.col_idx.push_back(col);
+                    result.values.push_back(value);
+                }
+            }
+            result.row_ptr.push_back(result.values.size());
+        }
+
+        *this = SparseMatrixBase(rows_, cols_, std::move(result));
+    }
+
+    template<typename Semiring = PlusTimes<value_type>>
+    value_type RowDot(index_type row, const value_type *x) const {
+        const RowView view = NonZeros(row);
+        const index_type *indices = view.Indices();
+        const value_type *values = view.Values();
+
+        value_type sum = Semiring::Zero();
+        for (size_type i = 0; i < view.RealSize(); i++) {
+            sum = Semiring::Add(sum, Semiring::Multiply(values[i], x[indices[i]]));
+        }
+
+        return sum;
+    }
+
+    std::vector<value_type> ToDense(const FlatSparseVector<value_type>& vec) const {
+        if (vec.size() != cols_) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        std::vector<value_type> dense(cols_);
+        for (const auto [index, value] : vec.NonZeros()) {
+            dense[index] = value;
+        }
+
+        return dense;
+    }
+
+    // Splits the rows into at most blocks consecutive ranges of about the
+    // same cost, a row costing its number of entries plus one. Range b is
+    // [bounds[b], bounds[b + 1]). Power-law rows get fewer rows per block
+    // where the heavy rows are, a single row is never split.
+    std::vector<index_type> RowBlocks(size_type blocks) const {
+        std::vector<size_type> cost;
+        if (!compressed_) {
+            cost.resize(rows_ + 1);
+            for (index_type row = 0; row < rows_; row++) {
+                cost[row + 1] = cost[row] + data_[row].RealSize();
+            }
+        }
+
+        const std::vector<size_type>& entries = compressed_ ? csr_.row_ptr : cost;
+        return SplitRows(blocks, [&](index_type row) {
+            return entries[row] + row;
+        });
+    }
+
+    // Same for any cost given as prefix(row), the total cost of the rows
+    // before row, which must not decrease.
+    template<typename Prefix>
+    std::vector<index_type> SplitRows(size_type blocks, Prefix prefix) const {
+        blocks = std::max<size_type>(1, std::min(blocks, rows_));
+        const size_type total = prefix(rows_);
+
+        std::vector<index_type> bounds(blocks + 1, rows_);
+        bounds[0] = 0;
+        for (size_type b = 1; b < blocks; b++) {
+            const size_type target = total * b / blocks;
+
+            index_type lo = bounds[b - 1];
+            index_type hi = rows_;
+            while (lo < hi) {
+                const index_type mid = lo + (hi - lo) / 2;
+                if (prefix(mid) < target) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            bounds[b] = lo;
+        }
+
+        return bounds;
+    }
+
+    // Product of the stored entries over a semiring, the offsets are left
+    // to the caller. See Multiply.
+    template<typename Semiring>
+    SparseMatrixBase MultiplyStored(const SparseMatrixBase& other, ThreadPool& pool) const {
+        if (!CanMultiply(*this, other)) {
+            throw std::invalid_argument(MATRIX_INVALID_SIZES);
+        }
+
+        const std::vector<index_type> bounds = ProductChunks(other, pool);
+
+        CsrStorage result;
+        result.row_ptr.resize(rows_ + 1);
+
+        std::vector<std::vector<index_type>> chunk_cols(bounds.size() - 1);
+        std::vector<std::vector<value_type>> chunk_values(bounds.size() - 1);
+        std::vector<std::unique_ptr<RowAccumulator<Semiring>>> accumulators(pool.Threads());
+
+        pool.Run(bounds.size() - 1, [&](size_type chunk) {
+            auto& accumulator = accumulators[ThreadPool::CurrentThread()];
+            if (!accumulator) {
+                accumulator = std::make_unique<RowAccumulator<Semiring>>(other.cols_);
+            }
+
+            std::vector<index_type>& cols = chunk_cols[chunk];
+            std::vector<value_type>& values = chunk_values[chunk];
+
+            for (index_type row = bounds[chunk]; row < bounds[chunk + 1]; row++) {
+                const RowView lhs = NonZeros(row);
+                for (size_type i = 0; i < lhs.RealSize(); i++) {
+                    const RowView rhs = other.NonZeros(lhs.Indices()[i]);
+                    const value_type scale = lhs.Values()[i];
+                    for (size_type j = 0; j < rhs.RealSize(); j++) {
+                        accumulator->Add(rhs.Indices()[j], Semiring::Multiply(scale, rhs.Values()[j]));
+                    }
+                }
+
+                const size_type before = values.size();
+                accumulator->Flush(cols, values);
+                result.row_ptr[row + 1] = values.size() - before;
+            }
+        });
+
+        for (index_type row = 0; row < rows_; row++) {
+            result.row_ptr[row + 1] += result.row_ptr[row];
+        }
+
+        if (bounds.size() == 2) {
+            result.col_idx = std::move(chunk_cols[0]);
+            result.values = std::move(chunk_values[0]);
+        } else {
+            result.col_idx.resize(result.row_ptr[rows_]);
+            result.values.resize(result.row_ptr[rows_]);
+
+            pool.Run(bounds.size() - 1, [&](size_type chunk) {
+                const size_type offset = result.row_ptr[bounds[chunk]];
+                std::copy(chunk_cols[chunk].begin(), chunk_cols[chunk].end(),
+                          result.col_idx.begin() + offset);
+                std::copy(chunk_values[chunk].begin(), chunk_values[chunk].end(),
+                          result.values.begin() + offset);
+            });
+        }
+
+        return SparseMatrixBase(rows_, other.cols_, std::move(result));
+    }
+
+    // Rows of this * other cut into a few chunks per thread with about the
+    // same number of multiplications. Small products get a single chunk,
+    // they are not worth waking the pool up for.
+    std::vector<index_type> ProductChunks(const SparseMatrixBase& other, ThreadPool& pool) const {
+        std::vector<size_type> flops(rows_ + 1);
+        for (index_type row = 0; row < rows_; row++) {
+            const RowView lhs = NonZeros(row);
+            size_type row_flops = 0;
+            for (size_type i = 0; i < lhs.RealSize(); i++) {
+                row_flops += other.NonZeros(lhs.Indices()[i]).RealSize();
+            }
+            flops[row + 1] = flops[row] + row_flops;
+        }
+
+        const size_type chunks = flops[rows_] < PARALLEL_MIN_FLOPS ? 1 : pool.Threads() * 4;
+        return SplitRows(chunks, [&](index_type row) {
+            return flops[row] + row;
+        });
+    }
+
+    // Sparse accumulator for one row of a product, summing with the
+    // semiring's Add. The dense arrays are reused for every row, touched
+    // remembers which of their cells are in use so that Flush costs
+    // O(row nnz) and not O(cols).
+    template<typename Semiring = PlusTimes<value_type>>
+    class RowAccumulator {
+    public:
+        explicit RowAccumulator(size_type cols)
+            : values_(cols)
+            , occupied_(cols) {}
+
+        void Add(index_type col, const value_type& value) {
+            if (occupied_[col]) {
+                values_[col] = Semiring::Add(values_[col], value);
+                return;
+            }
+
+            occupied_[col] = true;
+            values_[col] = value;
+            touched_.push_back(col);
+        }
+
+        // Appends the nonzeros of the row sorted by column and resets.
+        void Flush(std::vector<index_type>& cols, std::vector<value_type>& values) {
+            std::sort(touched_.begin(), touched_.end());
+
+            for (index_type col : touched_) {
+                if (values_[col] != Semiring::Zero()) {
+                    cols.push_back(col);
+                    values.push_back(values_[col]);
+                }
+                occupied_[col] = false;
+            }
+            touched_.clear();
+        }
+
+        // True if every column of the row is among the sorted cols.
+        bool Within(const index_type *cols, size_type n) const {
+            size_type found = 0;
+            for (size_type i = 0; i < n; i++) {
+                found += occupied_[cols[i]];
+            }
 
-    SparseMatrixBase& RowOperation(index_type row, const value_type& value, Operation op) {
-        if (row >= rows_)
-            throw std::invalid_argument(INDEX_OOB);
+            return found == touched_.size();
+        }
 
-        for (index_type i = 0; i < cols_; i++) {
-            switch (op) {
-                case ADD:
-                    Set(row, i, Get(row, i) + value);
-                    break;
-                case SUBTRACT:
-                    Set(row, i, Get(row, i) - value);
-                    break;
-                case MULTIPLY:
-                    Set(row, i, Get(row, i) * value);
-                    break;
-                case DIVIDE:
-                    Set(row, i, Get(row, i) / value);
-                    break;
+        // Sets values[i] = beta * values[i] + alpha * row[cols[i]] for the
+        // sorted cols, which must hold every column of the row, and resets.
+        void FlushInto(const value_type& alpha, const value_type& beta,
+                       const index_type *cols, value_type *values, size_type n) {
+            for (size_type i = 0; i < n; i++) {
+                const index_type col = cols[i];
+                values[i] = detail::GemmScaled(beta, values[i]);
+                if (occupied_[col]) {
+                    values[i] += alpha * values_[col];
+                    occupied_[col] = false;
+                }
             }
+            touched_.clear();
         }
 
-        return *this;
-    }
+        // Appends beta * (cols, values) + alpha * row, the first being a
+        // sorted row, keeps the nonzeros and resets.
+        void FlushMerged(const value_type& alpha, const value_type& beta,
+                         const index_type *cols, const value_type *values, size_type n,
+                         std::vector<index_type>& out_cols, std::vector<value_type>& out_values) {
+            std::sort(touched_.begin(), touched_.end());
+
+            size_type i = 0;
+            size_type j = 0;
+            while (i < n || j < touched_.size()) {
+                index_type col;
+                value_type value;
+                if (j == touched_.size() || (i < n && cols[i] < touched_[j])) {
+                    col = cols[i];
+                    value = detail::GemmScaled(beta, values[i++]);
+                } else if (i == n || touched_[j] < cols[i]) {
+                    col = touched_[j++];
+                    value = alpha * values_[col];
+                } else {
+                    col = cols[i];
+                    value = detail::GemmScaled(beta, values[i++]) + alpha * values_[touched_[j++]];
+                }
 
-    SparseMatrixBase& ColOperation(index_type col, const value_type& value, Operation op) {
-        if (col >= cols_)
-            throw std::invalid_argument(INDEX_OOB);
+                if (value != value_type()) {
+                    out_cols.push_back(col);
+                    out_values.push_back(value);
+                }
+            }
 
-        for (index_type i = 0; i < rows_; i++) {
-            switch (op) {
-                case ADD:
-                    Set(i, col, Get(i, col) + value);
-                    break;
-                case SUBTRACT:
-                    Set(i, col, Get(i, col) - value);
-                    break;
-                case MULTIPLY:
-                    Set(i, col, Get(i, col) * value);
-                    break;
-                case DIVIDE:
-                    Set(i, col, Get(i, col) / value);
-                    break;
+            for (index_type col : touched_) {
+                occupied_[col] = false;
             }
+            touched_.clear();
         }
 
-        return *this;
+    private:
+        std::vector<value_type> values_;
+        std::vector<bool> occupied_;
+        std::vector<index_type> touched_;
+    };
+
+    CsrStorage BuildCsr() const {
+        CsrStorage csr;
+        csr.row_ptr.reserve(rows_ + 1);
+        csr.row_ptr.push_back(0);
+
+        const size_type nnz = RealSize();
+        csr.col_idx.reserve(nnz);
+        csr.values.reserve(nnz);
+
+        for (const auto& row : data_) {
+            csr.col_idx.insert(csr.col_idx.end(), row.Indices().begin(), row.Indices().end());
+            csr.values.insert(csr.values.end(), row.Values().begin(), row.Values().end());
+            csr.row_ptr.push_back(csr.values.size());
+        }
+
+        return csr;
     }
 
-    SparseMatrixBase Transpose() const {
-        SparseMatrixBase result(cols_, rows_);
+    // Position of col in the compressed row, or of the first greater column.
+    size_type FindCompressed(index_type row, index_type col) const {
+        const auto first = csr_.col_idx.begin() + csr_.row_ptr[row];
+        const auto last  = csr_.col_idx.begin() + csr_.row_ptr[row + 1];
+
+        return std::lower_bound(first, last, col) - csr_.col_idx.begin();
+    }
+
+    template<typename Semiring>
+    friend class SemiringMatrix;
+
+    size_type rows_;
+    size_type cols_;
+    container_type data_;
+    bool compressed_ = false;
+    CsrStorage csr_;
+    value_type offset_ = value_type();
+};
+
+// Collects (row, col, value) triplets in any order and turns them into a
+// compressed matrix in one go, which is much cheaper than a Set per entry.
+// Entries with the same position are folded with the combiner in the
+// order they were added. To fill a matrix from several threads give each
+// thread its own builder and Append them afterwards.
+template<typename T>
+class SparseMatrixBuilder {
+public:
+    using value_type = T;
+    using index_type = std::size_t;
+    using size_type  = std::size_t;
+    using matrix_type = SparseMatrixBase<value_type>;
+
+    struct Triplet {
+        index_type row;
+        index_type col;
+        value_type value;
+    };
+
+    SparseMatrixBuilder(size_type rows, size_type cols)
+        : rows_(rows)
+        , cols_(cols) {}
+
+    void Reserve(size_type nnz) {
+        triplets_.reserve(nnz);
+    }
+
+    void Add(index_type row, index_type col, const value_type& value) {
+        if (row >= rows_) {
+            throw std::invalid_argument(ROW_OOB);
+        }
+
+        if (col >= cols_) {
+            throw std::invalid_argument(COL_OOB);
+        }
+
+        triplets_.push_back({ row, col, value });
+    }
+
+    void Append(SparseMatrixBuilder&& other) {
+        if ((cols_ != other.cols_) || (rows_ != other.rows_)) {
+            throw std::invalid_argument(MATRIX_SIZE_DIFFER);
+        }
+
+        if (triplets_.empty()) {
+            triplets_ = std::move(other.triplets_);
+        } else {
+            triplets_.insert(triplets_.end(), other.triplets_.begin(), other.triplets_.end());
+        }
+
+        other.triplets_.clear();
+    }
+
+    size_type size() const {
+        return triplets_.size();
+    }
+
+    // Counting sort by row followed by a stable sort of every row by column,
+    // then duplicates are folded and zeros dropped. O(nnz log(row nnz) + rows).
+    template<typename Combine = std::plus<value_type>>
+    matrix_type Build(Combine combine = Combine()) const {
+        std::vector<size_type> row_start(rows_ + 1);
+        for (const Triplet& triplet : triplets_) {
+            row_start[triplet.row + 1]++;
+        }
+
+        for (index_type row = 0; row < rows_; row++) {
+            row_start[row + 1] += row_start[row];
+        }
+
+        std::vector<std::pair<index_type, value_type>> entries(triplets_.size());
+        std::vector<size_type> next(row_start.begin(), row_start.end() - 1);
+        for (const Triplet& triplet : triplets_) {
+            entries[next[triplet.row]++] = { triplet.col, triplet.value };
+        }
 
-        for (index_type row = 0; row < rows_; ++row) {
-            for (index_type col = 0; col < cols_; ++col) {
-                if (data_.GetRef(row).Has(col)) {
-                    value_type value = data_.Get(row).Get(col);
-                    result.Set(col, row, value);
+        typename matrix_type::CsrStorage csr;
+        csr.row_ptr.reserve(rows_ + 1);
+        csr.row_ptr.push_back(0);
+        csr.col_idx.reserve(entries.size());
+        csr.values.reserve(entries.size());
+
+        for (index_type row = 0; row < rows_; row++) {
+            const auto first = entries.begin() + row_start[row];
+            const auto last  = entries.begin() + row_start[row + 1];
+
+            std::stable_sort(first, last, [](const auto& lhs, const auto& rhs) {
+                return lhs.first < rhs.first;
+            });
+
+            for (auto it = first; it != last;) {
+                const index_type col = it->first;
+                value_type value = it->second;
+
+                for (++it; it != last && it->first == col; ++it) {
+                    value = combine(value, it->second);
+                }
+
+                if (value != value_type()) {
+                    csr.col_idx.push_back(col);
+                    csr.values.push_back(value);
                 }
             }
+
+            csr.row_ptr.push_back(csr.values.size());
         }
 
-        return result;
+        return matrix_type(rows_, cols_, std::move(csr));
     }
 
-    size_type RealSize() const {
-        size_type rsize = 0;
-        for (const auto& row : data_) {
-            rsize += row.RealSize();
+private:
+    size_type rows_;
+    size_type cols_;
+    std::vector<Triplet> triplets_;
+};
+
+// A matrix over a semiring, the result of SparseMatrixBase::Multiply<S>.
+// Cells that are not stored are Semiring::Zero() (infinity for MinPlus),
+// entries equal to it are never stored and any other value may be, T()
+// included: a zero length path is a stored 0. That breaks the invariants
+// of SparseMatrixBase, so this type has no arithmetic operators and does
+// not convert back; it only gets multiplied further and read.
+template<typename Semiring>
+class SemiringMatrix {
+public:
+    using value_type  = typename Semiring::value_type;
+    using index_type  = std::size_t;
+    using size_type   = std::size_t;
+    using matrix_type = SparseMatrixBase<value_type>;
+    using CsrStorage  = typename matrix_type::CsrStorage;
+    using RowView     = typename matrix_type::RowView;
+
+    // Stored entries of matrix as the values of the semiring, e.g. edge
+    // lengths for MinPlus. The matrix must not have an offset.
+    explicit SemiringMatrix(matrix_type matrix)
+        : matrix_(std::move(matrix)) {
+        if (matrix_.Offset() != value_type()) {
+            throw std::invalid_argument(MATRIX_SEMIRING_OFFSET);
         }
 
-        return rsize;
+        matrix_.Compress();
+        DropZeros();
     }
 
-    size_type Cols() const {
-        return cols_;
+    // Takes ready CSR arrays, which may hold T() (a zero length edge).
+    SemiringMatrix(size_type rows, size_type cols, CsrStorage csr)
+        : SemiringMatrix(matrix_type(rows, cols, std::move(csr))) {}
+
+    // Stored entries are compared exactly.
+    bool operator==(const SemiringMatrix& other) const {
+        const CsrStorage& lhs = matrix_.Csr();
+        const CsrStorage& rhs = other.matrix_.Csr();
+
+        return Rows() == other.Rows() && Cols() == other.Cols()
+            && lhs.row_ptr == rhs.row_ptr && lhs.col_idx == rhs.col_idx && lhs.values == rhs.values;
     }
 
-    size_type Rows() const {
-        return rows_;
+    bool operator!=(const SemiringMatrix& other) const {
+        return !(*this == other);
     }
 
-    typename container_type::Iter begin() {
-        return data_.begin();
+    SemiringMatrix Multiply(const SemiringMatrix& other, ThreadPool& pool = DefaultThreadPool()) const {
+        return SemiringMatrix(matrix_.template MultiplyStored<Semiring>(other.matrix_, pool));
     }
 
-    typename container_type::Iter end() {
-        return data_.end();
+    void Multiply(const std::vector<value_type>& x, std::vector<value_type>& y,
+                  ThreadPool& pool = DefaultThreadPool()) const {
+        matrix_.template Multiply<Semiring>(x, y, pool);
     }
 
-    typename container_type::Iter begin() const {
-        return data_.begin();
+    std::vector<value_type> Multiply(const std::vector<value_type>& x,
+                                     ThreadPool& pool = DefaultThreadPool()) const {
+        return matrix_.template Multiply<Semiring>(x, pool);
     }
 
-    typename container_type::Iter end() const {
-        return data_.end();
+    value_type Get(index_type row, index_type col) const {
+        if (col >= Cols()) {
+            throw std::invalid_argument(COL_OOB);
+        }
+
+        const RowView view = NonZeros(row);
+        const index_type *last = view.Indices() + view.RealSize();
+        const index_type *pos = std::lower_bound(view.Indices(), last, col);
+
+        if (pos == last || *pos != col)
+            return Semiring::Zero();
+
+        return view.Values()[pos - view.Indices()];
     }
 
-    typename container_type::Iter cbegin() const {
-        return begin();
+    RowView NonZeros(index_type row) const {
+        return matrix_.NonZeros(row);
     }
 
-    typename container_type::Iter cend() const {
-        return end();
+    IterRange<typename matrix_type::NonZeroIter> NonZeros() const {
+        return matrix_.NonZeros();
     }
 
-    size_type size() const;
+    const CsrStorage& Csr() const {
+        return matrix_.Csr();
+    }
 
-    static SparseMatrixBase<value_type> FromVector(const SparseVector<value_type>& vec) {
-        SparseMatrixBase<value_type> result(vec.size(), 1);
+    size_type Rows() const {
+        return matrix_.Rows();
+    }
 
-        for (int i = 0; i < vec.size(); i++) {
-            result.Set(i, 0, vec.Get(i));
+    size_type Cols() const {
+        return matrix_.Cols();
+    }
+
+    size_type RealSize() const {
+        return matrix_.RealSize();
+    }
+
+private:
+    // Products never store Zero(), input matrices may (an infinite edge).
+    void DropZeros() {
+        const CsrStorage& csr = matrix_.Csr();
+        if (std::find(csr.values.begin(), csr.values.end(), Semiring::Zero()) == csr.values.end())
+            return;
+
+        CsrStorage result;
+        result.row_ptr.push_back(0);
+        for (index_type row = 0; row < Rows(); row++) {
+            for (size_type pos = csr.row_ptr[row]; pos < csr.row_ptr[row + 1]; pos++) {
+                if (csr.values[pos] != Semiring::Zero()) {
+                    result.col_idx.push_back(csr.col_idx[pos]);
+                    result.values.push_back(csr.values[pos]);
+                }
+            }
+            result.row_ptr.push_back(result.values.size());
         }
 
-        return result;
+        matrix_ = matrix_type(Rows(), Cols(), std::move(result));
     }
-protected:
-    size_type rows_;
-    size_type cols_;
-    container_type data_;
+
+    matrix_type matrix_;
 };
 
 class SparseMatrix : public SparseMatrixBase<double> {
@@ -570,8 +2665,8 @@ public:
     using value_type = double;
     using index_type = std::size_t;
     using size_type = std::size_t;
-    using row_type = SparseVector<value_type>;
-    using container_type = SparseVector<row_type>;
+    using row_type = FlatSparseVector<value_type>;
+    using container_type = std::vector<row_type>;
 
     static constexpr double EPSYLON = 10e-6;
     using SparseMatrixBase<double>::operator*;
@@ -589,68 +2684,76 @@ public:
     SparseMatrix(const SparseMatrixBase<double>& base)
         : SparseMatrixBase<double>(base) { /* nothing */ }
 
+    SparseMatrix(SparseMatrixBase<double>&& base)
+        : SparseMatrixBase<double>(std::move(base)) { /* nothing */ }
+
+    template<typename E, typename = std::enable_if_t<std::is_base_of<MatrixExpression, E>::value>>
+    SparseMatrix(const E& expr)
+        : SparseMatrixBase<double>(Evaluate(expr)) { /* nothing */ }
+
     bool IsInversable() const {
         return Determinant() != 0;
     }
 
     // Yes, I'm overloading it
     SparseMatrix SubMatrix(index_type exclusion_row, index_type exclusion_col) const {
-        SparseMatrixBase<value_type> base(*this);
-        return base.SubMatrix(exclusion_row, exclusion_col);
+        return SparseMatrixBase<value_type>::SubMatrix(exclusion_row, exclusion_col);
     }
 
-    SparseMatrix operator+(double value) const {
-        SparseMatrix result(*this);
-        for (index_type row = 0; row < result.Rows(); ++row) {
-            for (index_type col = 0; col < result.Cols(); ++col) {
-                result.Set(row, col, result.Get(row, col) + value);
-            }
-        }
-        return result;
+    // The && overloads work on the storage of an expiring matrix, so
+    // (a * b) * 2.0 scales the product where it lies.
+    SparseMatrix operator+(double value) const& {
+        return SparseMatrix(*this) + value;
     }
 
-    SparseMatrix operator-(double value) const {
-        SparseMatrix result(*this);
-        for (index_type row = 0; row < result.Rows(); ++row) {
-            for (index_type col = 0; col < result.Cols(); ++col) {
-                result.Set(row, col, result.Get(row, col) - value);
-            }
-        }
-        return result;
+    SparseMatrix operator+(double value) && {
+        *this += value;
+        return std::move(*this);
     }
 
+    SparseMatrix operator-(double value) const& {
+        return SparseMatrix(*this) - value;
+    }
 
-    SparseMatrix operator*(double value) const {
-        SparseMatrix result(*this);
-        for (index_type row = 0; row < result.Rows(); ++row) {
-            for (index_type col = 0; col < result.Cols(); ++col) {
-                result.Set(row, col, result.Get(row, col) * value);
-            }
-        }
-        return result;
+    SparseMatrix operator-(double value) && {
+        *this -= value;
+        return std::move(*this);
     }
 
-    SparseMatrix operator/(double value) const {
+    SparseMatrix operator*(double value) const& {
+        return SparseMatrix(*this) * value;
+    }
+
+    SparseMatrix operator*(double value) && {
+        *this *= value;
+        return std::move(*this);
+    }
+
+    SparseMatrix operator/(double value) const& {
+        return SparseMatrix(*this) / value;
+    }
+
+    SparseMatrix operator/(double value) && {
+        *this /= value;
+        return std::move(*this);
+    }
+
+    SparseMatrix& operator/=(double value) {
         if (std::abs(value) < EPSYLON) {
             throw std::invalid_argument("Division by zero");
         }
-        SparseMatrix result(*this);
-        for (index_type row = 0; row < result.Rows(); ++row) {
-            for (index_type col = 0; col < result.Cols(); ++col) {
-                result.Set(row, col, result.Get(row, col) / value);
-            }
-        }
-        return result;
+
+        SparseMatrixBase<double>::operator/=(value);
+        return *this;
     }
 
-    SparseMatrix PowElements(double exponent) const {
-        SparseMatrix result(*this);
-        for (index_type row = 0; row < result.Rows(); ++row) {
-            for (index_type col = 0; col < result.Cols(); ++col) {
-                result.Set(row, col, std::pow(result.Get(row, col), exponent));
-            }
-        }
-        return result;
+    SparseMatrix PowElements(double exponent) const& {
+        return SparseMatrix(*this).PowElements(exponent);
+    }
+
+    SparseMatrix PowElements(double exponent) && {
+        Apply([exponent](double value) { return std::pow(value, exponent); });
+        return std::move(*this);
     }
 
     bool operator==(const SparseMatrix& other) const {
@@ -658,92 +2761,99 @@ public:
             return false;
         }
 
-        for (index_type i = 0; i < rows_; i++) {
-            for (index_type j = 0; j < cols_; j++) {
-                if (!IsEqual(Get(i, j), other.Get(i, j), EPSYLON)) {
+        // Merge the stored entries of every row, a missing entry is the
+        // offset. If some cell is missing in both, the offsets must match.
+        const bool offsets_equal = IsEqual(offset_, other.offset_, EPSYLON);
+        for (index_type row = 0; row < rows_; row++) {
+            auto lhs = NonZeros(row);
+            auto rhs = other.NonZeros(row);
+            auto lhs_it = lhs.begin();
+            auto rhs_it = rhs.begin();
+            size_type visited = 0;
+
+            while (lhs_it != lhs.end() || rhs_it != rhs.end()) {
+                double lhs_value = offset_;
+                double rhs_value = other.offset_;
+                visited++;
+
+                if (rhs_it == rhs.end()
+                    || (lhs_it != lhs.end() && (*lhs_it).index < (*rhs_it).index)) {
+                    lhs_value += (*lhs_it++).value;
+                } else if (lhs_it == lhs.end() || (*rhs_it).index < (*lhs_it).index) {
+                    rhs_value += (*rhs_it++).value;
+                } else {
+                    lhs_value += (*lhs_it++).value;
+                    rhs_value += (*rhs_it++).value;
+                }
+
+                if (!IsEqual(lhs_value, rhs_value, EPSYLON)) {
                     return false;
                 }
             }
-        }
-
-        return true;
-    }
-
-    value_type Determinant() const {
-        index_type row = 0;
-        if (rows_ == 1) {
-            return Get(0, 0);
-        }
 
-        value_type result{};
-
-        index_type i = row;
-        for (index_type j = 0; j < cols_; j++) {
-            result = result + minus_one_pow(i + j) * Get(i, j)
-                * SubMatrix(i, j).Determinant();
+            if (visited < cols_ && !offsets_equal) {
+                return false;
+            }
         }
 
-        return result;
+        return true;
     }
 
-    SparseMatrix Inverse() const {
-        const size_type n = cols_;
-        SparseMatrix tmp = *this;
-        SparseMatrix inv = MakeIdentityMatrix<value_type>(n);
+    // Computed from a SparseLU factorization, see slu.hpp. Use SparseLU
+    // directly to also solve systems with the same matrix.
+    value_type Determinant() const;
 
-        for (size_type i = 0; i < n; i++) {
-            double pivot = tmp.Get(i, i);
-            tmp.ScaleRow(i, 1/pivot);
-            inv.ScaleRow(i, 1/pivot);
+    // Solves A * X = I column by column from a SparseLU factorization, in
+    // parallel on the default pool. SparseLU::InverseColumns and
+    // SparseLU::InverseEntry compute only a part of the inverse.
+    SparseMatrix Inverse() const;
 
-            for (size_type j = i + 1; j < n; j++) {
-                double factor = tmp.Get(j, i);
-                tmp.AddRowMultiple(i, j, -factor);
-                inv.AddRowMultiple(i, j, -factor);
-            }
+    // Binary exponentiation, O(log pow) products. A^0 is the identity and a
+    // negative power is a power of the inverse.
+    SparseMatrix Power(int pow) const {
+        if (!IsSquare()) {
+            throw std::invalid_argument(MATRIX_MUST_BE_SQUARE);
         }
 
-        for (size_type i = n - 1; i >= 1; i--) {
-            for (size_type j = i - 1; j >= 0; j--) {
-                double factor = tmp.Get(j, i);
-
-                tmp.AddRowMultiple(i, j, -factor);
-                inv.AddRowMultiple(i, j, -factor);
-
-                if (j == 0) break;
-            }
+        if (pow < 0) {
+            return Inverse().PowerBySquaring(-static_cast<long long>(pow));
         }
 
-        return inv;
+        return PowerBySquaring(pow);
     }
 
-    SparseMatrix Power(int pow) const {
-        auto result = *this;
-        for (int i = 1; i < pow; i++) {
-            result = result * (*this);
+private:
+    SparseMatrix PowerBySquaring(long long pow) const {
+        if (pow == 0) {
+            return MakeIdentityMatrix<value_type>(rows_);
         }
 
-        return result;
-    }
-
-private:
-    void AddRowMultiple(index_type row_from, index_type row_to, double multiple) {
-        for (int i = 0; i < cols_; i++) {
-            Set(row_to, i, Get(row_to, i) + Get(row_from, i) * multiple);
+        SparseMatrix square = *this;
+        while (pow % 2 == 0) {
+            square = square * square;
+            pow /= 2;
         }
-    }
 
-    void ScaleRow(index_type row, double multiple) {
-        for (int i = 0; i < cols_; i++) {
-            Set(row, i, Get(row, i) * multiple);
+        SparseMatrix result = square;
+        while (pow /= 2) {
+            square = square * square;
+            if (pow % 2 == 1)
+                result = result * square;
         }
+
+        return result;
     }
 };
 
 template<typename T>
-std::ostream& operator<<(std::ostream& out, SparseMatrixBase<T> matrix) {
+std::ostream& operator<<(std::ostream& out, const SparseMatrixBase<T>& matrix) {
     for (const auto& row : matrix) {
-        for (const auto elem : row) {
+        auto entry = row.begin();
+        for (std::size_t col = 0; col < matrix.Cols(); col++) {
+            T elem = matrix.Offset();
+            if (entry != row.end() && (*entry).index == col) {
+                elem += (*entry++).value;
+            }
             out << elem << " ";
         }
         out << std::endl;
@@ -751,21 +2861,107 @@ std::ostream& operator<<(std::ostream& out, SparseMatrixBase<T> matrix) {
     return out;
 }
 
+// Rows of the dense operand taken together by dense times sparse products.
+constexpr std::size_t SPMM_ROW_BLOCK = 8;
+
+// Dense times sparse, c = alpha * a * b + beta * c. Row i of c collects the
+// rows of b scaled by the cells of row i of a. Rows of a are taken
+// SPMM_ROW_BLOCK at a time, so every stored entry of b is read once per
+// block and added to all its rows; blocks run in parallel.
 template<typename T>
-SparseMatrixBase<T> MakeIdentityMatrix(std::size_t size) {
-    SparseMatrixBase<T> id(size, size);
-    for (typename SparseMatrixBase<T>::index_type i = 0; i < size; i++) {
-        for (typename SparseMatrixBase<T>::index_type j = 0; j < size; j++) {
-            if (i == j) {
-                id.Set(i, j, 1);
-                continue;
+void MultiplyAdd(const T& alpha, const VectorMatrix<T>& a, const SparseMatrixBase<T>& b,
+                 const T& beta, VectorMatrix<T>& c, ThreadPool& pool = DefaultThreadPool()) {
+    if (a.Cols() != b.Rows() || c.Rows() != a.Rows() || c.Cols() != b.Cols()) {
+        throw std::invalid_argument(MATRIX_INVALID_SIZES);
+    }
+
+    const std::size_t m = a.Rows();
+    const std::size_t n = b.Cols();
+    const std::size_t row_blocks = (m + SPMM_ROW_BLOCK - 1) / SPMM_ROW_BLOCK;
+    const std::size_t tasks = b.RealSize() * m < PARALLEL_MIN_FLOPS
+        ? 1 : std::min(row_blocks, pool.Threads() * 4);
+
+    pool.Run(tasks, [&](std::size_t task) {
+        T *out[SPMM_ROW_BLOCK];
+        const T *in[SPMM_ROW_BLOCK];
+        T scale[SPMM_ROW_BLOCK];
+
+        const std::size_t first_block = row_blocks * task / tasks;
+        const std::size_t last_block = row_blocks * (task + 1) / tasks;
+        for (std::size_t block = first_block; block < last_block; block++) {
+            const std::size_t first = block * SPMM_ROW_BLOCK;
+            const std::size_t count = std::min(SPMM_ROW_BLOCK, m - first);
+            for (std::size_t r = 0; r < count; r++) {
+                out[r] = c.RowData(first + r);
+                in[r] = a.RowData(first + r);
+                for (std::size_t col = 0; col < n; col++) {
+                    out[r][col] = detail::GemmScaled(beta, out[r][col]);
+                }
+            }
+
+            for (std::size_t k = 0; k < b.Rows(); k++) {
+                bool used = false;
+                for (std::size_t r = 0; r < count; r++) {
+                    scale[r] = alpha * in[r][k];
+                    used |= scale[r] != T();
+                }
+
+                if (!used)
+                    continue;
+
+                const typename SparseMatrixBase<T>::RowView row = b.NonZeros(k);
+                for (std::size_t i = 0; i < row.RealSize(); i++) {
+                    const std::size_t col = row.Indices()[i];
+                    const T value = row.Values()[i];
+                    for (std::size_t r = 0; r < count; r++) {
+                        out[r][col] += scale[r] * value;
+                    }
+                }
             }
 
-            id.Set(i, j, 0);
+            if (b.Offset() != T()) {
+                for (std::size_t r = 0; r < count; r++) {
+                    T sum = T();
+                    for (std::size_t k = 0; k < b.Rows(); k++) {
+                        sum += in[r][k];
+                    }
+
+                    const T shift = alpha * b.Offset() * sum;
+                    for (std::size_t col = 0; col < n; col++) {
+                        out[r][col] += shift;
+                    }
+                }
+            }
         }
+    });
+}
+
+template<typename T>
+VectorMatrix<T> Multiply(const VectorMatrix<T>& a, const SparseMatrixBase<T>& b, ThreadPool& pool) {
+    VectorMatrix<T> result(a.Rows(), b.Cols());
+    MultiplyAdd(T(1), a, b, T(), result, pool);
+    return result;
+}
+
+template<typename T>
+VectorMatrix<T> operator*(const VectorMatrix<T>& a, const SparseMatrixBase<T>& b) {
+    return Multiply(a, b, DefaultThreadPool());
+}
+
+template<typename T>
+SparseMatrixBase<T> MakeIdentityMatrix(std::size_t size) {
+    SparseMatrixBuilder<T> id(size, size);
+    id.Reserve(size);
+    for (typename SparseMatrixBase<T>::index_type i = 0; i < size; i++) {
+        id.Add(i, i, 1);
     }
 
-    return id;
+    return id.Build();
 }
 
+#include "slu.hpp"
+#include "krylov.hpp"
+#include "precond.hpp"
+#include "expr.hpp"
+
 #endif
\ No newline at end of file
@@ -0,0 +1,323 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+constexpr char POOL_TOO_MANY_TASKS[] = "Too many tasks for one Run";
+
+// A fixed set of worker threads reused by all parallel kernels. Run(tasks, f)
+// calls f(0) .. f(tasks - 1) and returns when all of them are done; the
+// calling thread takes tasks as well, so a pool of N threads has N - 1
+// workers. Run called from inside a task executes serially on the current
+// thread instead of deadlocking, and Runs from different threads take
+// turns, so dense and sparse kernels sharing a pool never oversubscribe
+// the cores.
+//
+// Tasks are scheduled by work stealing: every thread starts with its own
+// contiguous range of task numbers and takes them from the front, so
+// neighbouring tasks (rows, tiles) stay on one core. A thread that runs
+// out steals the back half of the range of another one.
+//
+// A pool of one thread runs the tasks in order on the caller, which makes
+// every kernel deterministic down to the order of floating point sums.
+//
+// While a task runs, CurrentThread() tells which of the Threads() threads
+// runs it, so kernels can keep per-thread scratch space without locking.
+class ThreadPool {
+public:
+    using size_type = std::size_t;
+
+    // Task numbers of a Run must fit in 32 bits.
+    static constexpr size_type MAX_TASKS = 0xffffffff;
+
+    explicit ThreadPool(size_type threads)
+        : threads_(threads == 0 ? 1 : threads)
+        , ranges_(threads_) {
+        workers_.reserve(threads_ - 1);
+        for (size_type i = 1; i < threads_; i++) {
+            workers_.emplace_back([this, i] { WorkerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+
+        wake_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_type Threads() const {
+        return threads_;
+    }
+
+    // Index in [0, Threads()) of the thread running the current task.
+    static size_type CurrentThread() {
+        return CurrentIndex();
+    }
+
+    template<typename F>
+    void Run(size_type tasks, F&& f) {
+        if (tasks == 0)
+            return;
+
+        if (tasks > MAX_TASKS) {
+            throw std::invalid_argument(POOL_TOO_MANY_TASKS);
+        }
+
+        if (threads_ == 1 || tasks == 1 || InsideTask()) {
+            const IndexGuard guard(0);
+            for (size_type task = 0; task < tasks; task++) {
+                f(task);
+            }
+
+            return;
+        }
+
+        std::lock_guard<std::mutex> run_lock(run_mutex_);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            // Late workers of the previous Run may still be leaving Drain.
+            done_.wait(lock, [this] { return active_ == 0; });
+
+            job_ = std::ref(f);
+            pending_ = tasks;
+            for (size_type i = 0; i < threads_; i++) {
+                ranges_[i].Reset(tasks * i / threads_, tasks * (i + 1) / threads_);
+            }
+            error_ = nullptr;
+            generation_++;
+        }
+
+        wake_.notify_all();
+
+        {
+            const IndexGuard guard(0);
+            Drain();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+        job_ = nullptr;
+
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    static bool& InsideTask() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    static size_type& CurrentIndex() {
+        static thread_local size_type index = 0;
+        return index;
+    }
+
+    // Gives the current thread another index for the duration of a Run.
+    class IndexGuard {
+    public:
+        explicit IndexGuard(size_type index)
+            : saved_(CurrentIndex()) {
+            CurrentIndex() = index;
+        }
+
+        ~IndexGuard() {
+            CurrentIndex() = saved_;
+        }
+
+    private:
+        size_type saved_;
+    };
+
+    void WorkerLoop(size_type index) {
+        CurrentIndex() = index;
+
+        size_type seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        while (true) {
+            wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_)
+                return;
+
+            seen = generation_;
+            active_++;
+            lock.unlock();
+
+            Drain();
+
+            lock.lock();
+            active_--;
+            if (active_ == 0)
+                done_.notify_all();
+        }
+    }
+
+    // Task numbers [begin, end) not taken yet, packed in one word so that
+    // the owner taking the front and thieves taking the back never hand
+    // out a task twice.
+    struct alignas(64) TaskRange {
+        std::atomic<std::uint64_t> bounds{0};
+
+        static std::uint64_t Pack(size_type begin, size_type end) {
+            return (static_cast<std::uint64_t>(begin) << 32) | end;
+        }
+
+        void Reset(size_type begin, size_type end) {
+            bounds = Pack(begin, end);
+        }
+
+        bool PopFront(size_type& task) {
+            std::uint64_t cur = bounds;
+            while (true) {
+                const size_type begin = cur >> 32;
+                const size_type end = cur & 0xffffffff;
+                if (begin >= end)
+                    return false;
+
+                if (bounds.compare_exchange_weak(cur, Pack(begin + 1, end))) {
+                    task = begin;
+                    return true;
+                }
+            }
+        }
+
+        // Takes the back half, at least one task.
+        bool StealBack(size_type& begin, size_type& end) {
+            std::uint64_t cur = bounds;
+            while (true) {
+                const size_type first = cur >> 32;
+                const size_type last = cur & 0xffffffff;
+                if (first >= last)
+                    return false;
+
+                const size_type mid = first + (last - first) / 2;
+                if (bounds.compare_exchange_weak(cur, Pack(first, mid))) {
+                    begin = mid;
+                    end = last;
+                    return true;
+                }
+            }
+        }
+    };
+
+    // The next task for thread self: its own range first, then half of
+    // the range of the first other thread that has some left.
+    bool NextTask(size_type self, size_type& task) {
+        if (ranges_[self].PopFront(task))
+            return true;
+
+        for (size_type i = 1; i < threads_; i++) {
+            size_type begin;
+            size_type end;
+            if (ranges_[(self + i) % threads_].StealBack(begin, end)) {
+                ranges_[self].Reset(begin + 1, end);
+                task = begin;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Drain() {
+        InsideTask() = true;
+
+        const size_type self = CurrentIndex();
+        size_type finished = 0;
+        size_type task;
+        while (NextTask(self, task)) {
+            try {
+                job_(task);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!error_)
+                    error_ = std::current_exception();
+            }
+            finished++;
+        }
+
+        InsideTask() = false;
+
+        if (finished != 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_ -= finished;
+            if (pending_ == 0)
+                done_.notify_all();
+        }
+    }
+
+    size_type threads_;
+    std::vector<std::thread> workers_;
+
+    std::mutex run_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+
+    std::function<void(size_type)> job_;
+    std::vector<TaskRange> ranges_;
+    size_type pending_ = 0;
+    size_type active_ = 0;
+    size_type generation_ = 0;
+    std::exception_ptr error_;
+    bool stop_ = false;
+};
+
+namespace detail {
+
+// SMATRIX_THREADS if it is a positive number, one per hardware thread
+// otherwise.
+inline std::size_t InitialThreadCount() {
+    if (const char *env = std::getenv("SMATRIX_THREADS")) {
+        char *end = nullptr;
+        const unsigned long threads = std::strtoul(env, &end, 10);
+        if (end != env && *end == '\0' && threads > 0)
+            return threads;
+    }
+
+    return std::thread::hardware_concurrency();
+}
+
+inline std::unique_ptr<ThreadPool>& DefaultThreadPoolHolder() {
+    static std::unique_ptr<ThreadPool> pool = std::make_unique<ThreadPool>(InitialThreadCount());
+    return pool;
+}
+
+} // namespace detail
+
+// The pool shared by the sparse and the dense kernels when none is passed
+// explicitly. Its size comes from the SMATRIX_THREADS environment variable,
+// by default one thread per hardware thread; SMATRIX_THREADS=1 is the
+// deterministic single thread mode.
+inline ThreadPool& DefaultThreadPool() {
+    return *detail::DefaultThreadPoolHolder();
+}
+
+// Replaces the default pool. Must not be called while it is in use.
+inline void SetDefaultThreadCount(std::size_t threads) {
+    detail::DefaultThreadPoolHolder() = std::make_unique<ThreadPool>(threads);
+}
+
+#endif
@@ -1,83 +1,195 @@
+#ifndef _VMATRIX_H_
+#define _VMATRIX_H_
+
+#include <algorithm>
 #include <cstddef>
 #include <initializer_list>
 #include <iostream>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
+#include "thread_pool.hpp"
+
+constexpr char VMATRIX_INVALID_SIZES[] = "Matrices are of invalid sizes";
+
+// Rows of a VectorMatrix start on this boundary: a cache line, and the
+// widest SIMD load is aligned.
+constexpr std::size_t VMATRIX_ALIGNMENT = 64;
+
+// Allocator of blocks aligned to Alignment bytes, for std::vector.
+template<typename T, std::size_t Alignment>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T *ptr, std::size_t) {
+        ::operator delete(ptr, std::align_val_t(Alignment));
+    }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const {
+        return false;
+    }
+};
+
+// size cells lying stride cells apart, a row (stride 1) or a column of a
+// matrix. Does not own the cells and is invalidated with the matrix.
+template<typename T>
+class StridedSpan {
+public:
+    using value_type = std::remove_const_t<T>;
+    using size_type = std::size_t;
+    using index_type = std::size_t;
+
+    class Iter {
+    public:
+        Iter(T *ptr, size_type stride)
+            : ptr_(ptr)
+            , stride_(stride) {}
+
+        T& operator*() const {
+            return *ptr_;
+        }
+
+        Iter& operator++() {
+            ptr_ += stride_;
+            return *this;
+        }
+
+        bool operator==(const Iter& other) const {
+            return ptr_ == other.ptr_;
+        }
+
+        bool operator!=(const Iter& other) const {
+            return ptr_ != other.ptr_;
+        }
+
+    private:
+        T *ptr_;
+        size_type stride_;
+    };
+
+    StridedSpan(T *data, size_type size, size_type stride)
+        : data_(data)
+        , size_(size)
+        , stride_(stride) {}
+
+    T& operator[](index_type index) const {
+        return data_[index * stride_];
+    }
+
+    T* data() const {
+        return data_;
+    }
+
+    size_type size() const {
+        return size_;
+    }
+
+    size_type Stride() const {
+        return stride_;
+    }
+
+    Iter begin() const {
+        return Iter(data_, stride_);
+    }
+
+    Iter end() const {
+        return Iter(data_ + size_ * stride_, stride_);
+    }
+
+private:
+    T *data_;
+    size_type size_;
+    size_type stride_;
+};
+
+template<typename T>
+void DenseGemm(std::size_t m, std::size_t n, std::size_t k, const T& alpha,
+               const T *a, std::size_t lda, const T *b, std::size_t ldb,
+               const T& beta, T *c, std::size_t ldc, ThreadPool& pool);
+
+// Dense row-major matrix in one aligned buffer. Every row starts on a
+// VMATRIX_ALIGNMENT boundary: rows are Stride() cells apart, the padding
+// after the last column is kept zero.
 template<typename T>
 class VectorMatrix {
 public:
     using size_type = size_t;
     using index_type = size_t;
     using value_type = T;
-    using row_type = std::vector<value_type>;
-    using container_type = std::vector<row_type>;
+    using container_type = std::vector<value_type, AlignedAllocator<value_type, VMATRIX_ALIGNMENT>>;
+    using span_type = StridedSpan<value_type>;
+    using const_span_type = StridedSpan<const value_type>;
 
-private:
-
-public:
     VectorMatrix()
         : rows_(0)
         , cols_(0)
+        , stride_(0)
     { /* nothing */ }
 
     VectorMatrix(size_type rows, size_type cols)
         : rows_(rows)
         , cols_(cols)
-    {
-            data_.resize(rows_);
-            for (row_type& row : data_) {
-                row.resize(cols_);
-            }
-    }
+        , stride_(PaddedStride(cols))
+        , data_(rows_ * stride_)
+    { /* nothing */ }
 
     VectorMatrix(const VectorMatrix& other) = default;
-    VectorMatrix(const std::initializer_list<std::initializer_list<value_type>>& values) {
-        rows_ = values.size();
-        cols_ = values.begin()->size();
-
-        data_.resize(rows_);
-        for (row_type& row : data_) {
-            row.resize(cols_);
-        }
+    VectorMatrix(VectorMatrix&& other) = default;
 
+    VectorMatrix(const std::initializer_list<std::initializer_list<value_type>>& values)
+        : VectorMatrix(values.size(), values.begin()->size()) {
         index_type i = 0;
-        for (const auto& row : values ) {
-                index_type j = 0;
-                if (i >= rows_) {
-                        break;
-                }
-
-                for (const auto& el : row) {
-                        if (j >= cols_)
-                                break;
-
-                        Set(i, j, el);
-                        j++;
-                }
-                i++;
+        for (const auto& row : values) {
+            index_type j = 0;
+            for (const auto& el : row) {
+                if (j >= cols_)
+                    break;
+
+                Set(i, j, el);
+                j++;
+            }
+            i++;
         }
     }
 
     VectorMatrix& operator=(const VectorMatrix& other) = default;
+    VectorMatrix& operator=(VectorMatrix&& other) = default;
 
     VectorMatrix&
     operator=(const std::initializer_list<std::initializer_list<value_type>>& values) {
-        VectorMatrix<value_type> other(values);
-
-        *this = values;
+        *this = VectorMatrix<value_type>(values);
         return *this;
     }
 
-
     bool operator==(const VectorMatrix& other) const {
         if (!SameShape(*this, other))
             return false;
 
-        for (int i = 0; i < rows_; i++) {
-            for (int j = 0; j < cols_; j++) {
-                if (data_[i][j] != other.data_[i][j])
-                    return false;
-            }
+        for (index_type i = 0; i < rows_; i++) {
+            if (!std::equal(RowData(i), RowData(i) + cols_, other.RowData(i)))
+                return false;
         }
 
         return true;
@@ -94,47 +206,102 @@ public:
         return true;
     }
 
+    // Same shapes mean same strides, so both run over the whole buffers
+    // in one flat loop.
     VectorMatrix operator+(const VectorMatrix& other) const {
+        if (!SameShape(*this, other)) {
+            throw std::invalid_argument(VMATRIX_INVALID_SIZES);
+        }
+
         VectorMatrix<value_type> result(rows_, cols_);
-        for (int i = 0; i < rows_; i++) {
-            for (int j = 0; j < cols_; j++) {
-                result.data_[i][j] = data_[i][j] + other.data_[i][j];
-            }
+        for (index_type i = 0; i < data_.size(); i++) {
+            result.data_[i] = data_[i] + other.data_[i];
         }
 
         return result;
     }
 
     VectorMatrix operator-(const VectorMatrix& other) const {
+        if (!SameShape(*this, other)) {
+            throw std::invalid_argument(VMATRIX_INVALID_SIZES);
+        }
+
         VectorMatrix<value_type> result(rows_, cols_);
-        for (int i = 0; i < rows_; i++) {
-            for (int j = 0; j < cols_; j++) {
-                result.data_[i][j] = data_[i][j] - other.data_[i][j];
-            }
+        for (index_type i = 0; i < data_.size(); i++) {
+            result.data_[i] = data_[i] - other.data_[i];
         }
 
         return result;
     }
 
     VectorMatrix operator*(const VectorMatrix& other) const {
-        VectorMatrix<value_type> result(rows_, cols_);
-        for (size_t i = 0; i < rows_; ++i) {
-            for (size_t j = 0; j < other.cols_; ++j) {
-                for (size_t k = 0; k < cols_; ++k) {
-                    result.data_[i][j] += data_[i][k] * other.data_[k][j];
-                }
-            }
-        }
+        return Multiply(other, DefaultThreadPool());
+    }
 
+    // Blocked product on the pool, see gemm.hpp.
+    VectorMatrix Multiply(const VectorMatrix& other, ThreadPool& pool) const {
+        VectorMatrix<value_type> result(rows_, other.cols_);
+        MultiplyAdd(value_type(1), other, value_type(), result, pool);
         return result;
     }
 
+    // c = alpha * this * other + beta * c, c must be rows x other.cols and
+    // neither of the operands.
+    void MultiplyAdd(const value_type& alpha, const VectorMatrix& other, const value_type& beta,
+                     VectorMatrix& c, ThreadPool& pool = DefaultThreadPool()) const {
+        if (cols_ != other.rows_ || c.rows_ != rows_ || c.cols_ != other.cols_) {
+            throw std::invalid_argument(VMATRIX_INVALID_SIZES);
+        }
+
+        DenseGemm(rows_, other.cols_, cols_, alpha, Data(), stride_,
+                  other.Data(), other.stride_, beta, c.Data(), c.stride_, pool);
+    }
+
     value_type Get(index_type row, index_type col) const {
-        return data_[row][col];
+        return data_[row * stride_ + col];
     }
 
     void Set(index_type row, index_type col, const value_type& value) {
-        data_[row][col] = value;
+        data_[row * stride_ + col] = value;
+    }
+
+    // Cells of a row, contiguous and aligned.
+    value_type* RowData(index_type row) {
+        return data_.data() + row * stride_;
+    }
+
+    const value_type* RowData(index_type row) const {
+        return data_.data() + row * stride_;
+    }
+
+    span_type Row(index_type row) {
+        return span_type(RowData(row), cols_, 1);
+    }
+
+    const_span_type Row(index_type row) const {
+        return const_span_type(RowData(row), cols_, 1);
+    }
+
+    span_type Col(index_type col) {
+        return span_type(data_.data() + col, rows_, stride_);
+    }
+
+    const_span_type Col(index_type col) const {
+        return const_span_type(data_.data() + col, rows_, stride_);
+    }
+
+    // The whole buffer, Rows() * Stride() cells.
+    value_type* Data() {
+        return data_.data();
+    }
+
+    const value_type* Data() const {
+        return data_.data();
+    }
+
+    // Distance in cells between the starts of two rows.
+    size_type Stride() const {
+        return stride_;
     }
 
     size_type Cols() const {
@@ -146,28 +313,37 @@ public:
     }
 
 private:
-    container_type data_;
+    // cols rounded up to whole alignment blocks.
+    static size_type PaddedStride(size_type cols) {
+        const size_type block = std::max<size_type>(1, VMATRIX_ALIGNMENT / sizeof(value_type));
+        return (cols + block - 1) / block * block;
+    }
+
     size_type rows_;
     size_type cols_;
+    size_type stride_;
+    container_type data_;
 };
 
 template <typename T>
 std::ostream& operator<<(std::ostream& out, const VectorMatrix<T>& mat) {
-    bool is_first = true;
-    for (const auto row : mat) {
+    for (typename VectorMatrix<T>::index_type i = 0; i < mat.Rows(); i++) {
+        if (i != 0)
+            out << std::endl;
+
         bool is_first_el = true;
-        for (const auto el : row) {
+        for (const auto& el : mat.Row(i)) {
             if (!is_first_el)
                 out << ' ';
 
             is_first_el = false;
             out << el;
         }
-        if (!is_first)
-            out << std::endl;
-
-        is_first = false;
     }
 
     return out;
-}
\ No newline at end of file
+}
+
+#include "gemm.hpp"
+
+#endif